@@ -0,0 +1,42 @@
+#ifndef COROUTINE_HPP
+#define COROUTINE_HPP
+
+#include <cstddef>
+#include <new>
+#include "malloc.h"
+
+namespace halloc
+{
+
+/** Base for C++20 coroutine promise types. The compiler allocates the
+* coroutine frames of a promise deriving from it with halloc_frame_alloc,
+* so frames are recycled by the thread which created them instead of
+* going through the global operator new.
+*
+*   struct task {
+*       struct promise_type : halloc::frame_allocated { ... };
+*   };
+*/
+struct frame_allocated
+{
+    static void* operator new(std::size_t size)
+    {
+        void* frame = halloc_frame_alloc(size);
+
+        if (frame == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+
+        return frame;
+    }
+
+    static void operator delete(void* ptr, std::size_t size) noexcept
+    {
+        halloc_frame_free(ptr, size);
+    }
+};
+
+} // namespace halloc
+
+#endif
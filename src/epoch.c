@@ -0,0 +1,332 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "malloc.h"
+
+/*************************************************************************************************/
+/*********************************** Constants definitions ***************************************/
+
+#define EPOCH_BUCKETS               3   // Retired objects can only be from the current and the two previous epochs
+#define EPOCH_COLLECT_THRESHOLD     64  // Retired objects a thread accumulates before trying to collect
+
+/*************************************************************************************************/
+/*********************************** Structs definitions *****************************************/
+
+/**
+ * Per thread state of the epoch based reclamation. Records are allocated from the heap once and
+ * never freed: when its thread exits a record is left unowned and reused by the next thread
+ * which needs one, together with any objects still retired in it.
+ *************************************************************************************************/
+typedef struct EpochRecord_s
+{
+    uint32_t owned;                          // A live thread uses this record(1) or not(0)
+    uint32_t nesting;                        // Depth of critical regions, 0 when quiescent
+    uint64_t epoch;                          // Global epoch observed when entering the outermost region
+
+    void*    retired[EPOCH_BUCKETS];         // Retired objects chained through their first word
+    uint64_t retiredEpoch[EPOCH_BUCKETS];    // Epoch in which the objects of each chain were retired
+    uint32_t retiredCount;                   // Objects retired since the last collection
+
+    struct EpochRecord_s* next;              // Next record in the registry
+
+} EpochRecord_t;
+
+/*************************************************************************************************/
+/*********************************** Global variables ********************************************/
+
+/**
+ * @brief globalEpoch Current epoch, advanced when every thread inside a critical region observed it
+ *************************************************************************************************/
+static uint64_t        globalEpoch = EPOCH_BUCKETS;
+
+/**
+ * @brief recordList Registry of all records ever created
+ *************************************************************************************************/
+static EpochRecord_t*  recordList = NULL;
+
+/**
+ * @brief threadRecord Record owned by the calling thread
+ *************************************************************************************************/
+static __thread EpochRecord_t* threadRecord = NULL;
+
+/*************************************************************************************************/
+/*********************************** Epoch record methods ****************************************/
+
+/**
+ * @brief EpochRecord_reclaim Free the retired chains which no thread can reference anymore
+ * @param _this               Record whose chains will be checked
+ * @param epoch               Current global epoch
+ * @return                    Number of objects freed
+ *************************************************************************************************/
+static size_t EpochRecord_reclaim(EpochRecord_t* _this, uint64_t epoch)
+{
+    uint32_t i;
+    size_t   count = 0;
+
+    for (i = 0; i < EPOCH_BUCKETS; i++)
+    {
+        void* it;
+
+        // Every thread inside a region when the chain was retired has left it
+        if (_this->retired[i] == NULL || _this->retiredEpoch[i] + 2 > epoch)
+        {
+            continue;
+        }
+
+        for (it = _this->retired[i]; it != NULL; it = *(void**)it)
+        {
+            count++;
+        }
+
+        halloc_free_batch(_this->retired[i]);
+        _this->retired[i] = NULL;
+    }
+
+    return count;
+}
+
+/**
+ * @brief EpochRecord_release Leave the record of an exiting thread to be reused by another thread
+ * @param arg                 The record
+ *************************************************************************************************/
+static void EpochRecord_release(void* arg)
+{
+    EpochRecord_t* _this = (EpochRecord_t*) arg;
+
+    _this->nesting = 0;
+    threadRecord   = NULL;
+
+    __atomic_store_n(&_this->owned, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief EpochRecord_acquire Get the record of the calling thread, adopting or creating one
+ * @return                    The record or NULL if none could be created
+ *************************************************************************************************/
+static EpochRecord_t* EpochRecord_acquire()
+{
+    EpochRecord_t* record;
+
+    if (threadRecord != NULL)
+    {
+        return threadRecord;
+    }
+
+    // Adopt a record left by a thread which exited
+    for (record = __atomic_load_n(&recordList, __ATOMIC_ACQUIRE);
+         record != NULL;
+         record = record->next)
+    {
+        uint32_t unowned = 0;
+
+        if (__atomic_compare_exchange_n(&record->owned, &unowned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    if (record == NULL)
+    {
+        uint32_t i;
+
+        record = (EpochRecord_t*) malloc(sizeof(EpochRecord_t));
+
+        if (record == NULL)
+        {
+            return NULL;
+        }
+
+        record->owned        = 1;
+        record->nesting      = 0;
+        record->epoch        = 0;
+        record->retiredCount = 0;
+
+        for (i = 0; i < EPOCH_BUCKETS; i++)
+        {
+            record->retired[i]      = NULL;
+            record->retiredEpoch[i] = 0;
+        }
+
+        record->next = __atomic_load_n(&recordList, __ATOMIC_RELAXED);
+
+        while (!__atomic_compare_exchange_n(&recordList, &record->next, record, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+            // record->next was reloaded by the failed exchange
+        }
+    }
+
+    if (libhalloc_thread_exit(EpochRecord_release, record) != 0)
+    {
+        __atomic_store_n(&record->owned, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    threadRecord = record;
+
+    return record;
+}
+
+/*************************************************************************************************/
+/*********************************** Utilitary functions *****************************************/
+
+/**
+ * @brief tryAdvanceEpoch Advance the global epoch if every thread in a critical region observed it
+ * @return                The global epoch after the attempt
+ *************************************************************************************************/
+static uint64_t tryAdvanceEpoch()
+{
+    EpochRecord_t* it;
+    uint64_t       epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+
+    for (it = __atomic_load_n(&recordList, __ATOMIC_ACQUIRE); it != NULL; it = it->next)
+    {
+        if (__atomic_load_n(&it->nesting, __ATOMIC_SEQ_CST) != 0 &&
+            __atomic_load_n(&it->epoch, __ATOMIC_SEQ_CST)   != epoch)
+        {
+            return epoch;
+        }
+    }
+
+    // Losing the race means another thread advanced it
+    __atomic_compare_exchange_n(&globalEpoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief collect Advance the epoch and free what became safe in the calling thread's record and
+ *                in the records left by exited threads
+ * @param record  Record of the calling thread
+ * @return        Number of objects freed
+ *************************************************************************************************/
+static size_t collect(EpochRecord_t* record)
+{
+    EpochRecord_t* it;
+    uint64_t       epoch = tryAdvanceEpoch();
+    size_t         count = EpochRecord_reclaim(record, epoch);
+
+    record->retiredCount = 0;
+
+    for (it = __atomic_load_n(&recordList, __ATOMIC_ACQUIRE); it != NULL; it = it->next)
+    {
+        uint32_t unowned = 0;
+
+        if (it == record || __atomic_load_n(&it->owned, __ATOMIC_RELAXED) != 0)
+        {
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&it->owned, &unowned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            count += EpochRecord_reclaim(it, epoch);
+            __atomic_store_n(&it->owned, 0, __ATOMIC_RELEASE);
+        }
+    }
+
+    return count;
+}
+
+/*************************************************************************************************/
+/*********************************** Public interface functions **********************************/
+
+/**
+ * @brief halloc_epoch_enter
+ *************************************************************************************************/
+void halloc_epoch_enter()
+{
+    EpochRecord_t* record = EpochRecord_acquire();
+
+    if (record == NULL)
+    {
+        return;
+    }
+
+    if (record->nesting > 0)
+    {
+        record->nesting++;
+        return;
+    }
+
+    // The observed epoch must be visible before any access to the shared structure
+    __atomic_store_n(&record->nesting, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&record->epoch, __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief halloc_epoch_leave
+ *************************************************************************************************/
+void halloc_epoch_leave()
+{
+    EpochRecord_t* record = threadRecord;
+
+    if (record == NULL || record->nesting == 0)
+    {
+        return;
+    }
+
+    if (record->nesting == 1)
+    {
+        __atomic_store_n(&record->nesting, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    record->nesting--;
+}
+
+/**
+ * @brief halloc_retire
+ * @param ptr
+ *************************************************************************************************/
+void halloc_retire(void* ptr)
+{
+    EpochRecord_t* record;
+    uint64_t       epoch;
+    uint32_t       i;
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    record = EpochRecord_acquire();
+
+    if (record == NULL)
+    {
+        return; // Leak rather than free something which may still be referenced
+    }
+
+    epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    i     = epoch % EPOCH_BUCKETS;
+
+    // The bucket still holds objects from three or more epochs ago: they are safe by now
+    if (record->retired[i] != NULL && record->retiredEpoch[i] != epoch)
+    {
+        halloc_free_batch(record->retired[i]);
+        record->retired[i] = NULL;
+    }
+
+    *(void**)ptr            = record->retired[i];
+    record->retired[i]      = ptr;
+    record->retiredEpoch[i] = epoch;
+
+    if (++record->retiredCount >= EPOCH_COLLECT_THRESHOLD)
+    {
+        collect(record);
+    }
+}
+
+/**
+ * @brief halloc_epoch_collect
+ * @return
+ *************************************************************************************************/
+size_t halloc_epoch_collect()
+{
+    EpochRecord_t* record = EpochRecord_acquire();
+
+    if (record == NULL)
+    {
+        return 0;
+    }
+
+    return collect(record);
+}
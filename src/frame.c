@@ -0,0 +1,582 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "malloc.h"
+#include "spinlock.h"
+
+/*************************************************************************************************/
+/*********************************** Constants definitions ***************************************/
+
+#define FRAME_GRANULARITY           64  // Frame sizes are rounded up to multiples of 64 bytes
+#define FRAME_CLASSES               16  // Frames up to 1 KiB are recycled, bigger ones go to the heap
+#define FRAME_CACHE_DEPTH           64  // Frames each thread keeps per class
+#define TRANSFER_BATCH              32  // Frames moved at once between thread caches and the transfer cache
+#define TRANSFER_SLOTS              16  // Batches the transfer cache keeps per class
+
+/*************************************************************************************************/
+/*********************************** Structs definitions *****************************************/
+
+/**
+ * Per thread stacks of recycled frames, one per frame size class. Frames are chained through
+ * their first word, so the most recently freed frame (the one most likely in cache) is reused
+ * first.
+ *
+ * The low-water mark of a class is the fewest frames its stack held since the cache was last
+ * scavenged: that many frames at the bottom of the stack were not needed during a whole
+ * scavenging interval, and are the ones given back to the heap.
+ *************************************************************************************************/
+typedef struct FrameCache_s
+{
+    void*    frames[FRAME_CLASSES];     // Top of the stack of each class
+    uint32_t count[FRAME_CLASSES];      // Frames in the stack of each class
+    uint32_t lowWater[FRAME_CLASSES];   // Fewest frames in the stack of each class since the last scavenge
+    uint32_t registered;                // Release at thread exit was registered(1) or not(0)
+
+    uint32_t lock;                      // Taken by the owner on each operation and by the scavenger
+    uint32_t active;                    // The owner used the cache since the last scavenge(1) or not(0)
+    uint64_t generation;                // Scavenging interval in which the owner last scavenged it
+
+    struct FrameCache_s* next;          // Next cache in the registry
+    struct FrameCache_s* previous;      // Previous cache in the registry
+
+} FrameCache_t;
+
+/**
+ * Frames in transit between threads, one per frame size class. A thread whose stack of a class
+ * overflows hands a batch of TRANSFER_BATCH frames over, a thread whose stack runs empty takes a
+ * whole batch back, so frames freed by one thread are reused by another without going through
+ * the heap. Batches are chains of frames linked through their first word.
+ *************************************************************************************************/
+typedef struct TransferCache_s
+{
+    uint32_t lock;                      // Taken for each batch moved
+    uint32_t count;                     // Batches in the cache
+    uint32_t lowWater;                  // Fewest batches in the cache since the last scavenge
+    void*    batches[TRANSFER_SLOTS];   // Heads of the batches
+
+} TransferCache_t;
+
+/*************************************************************************************************/
+/*********************************** Global variables ********************************************/
+
+/**
+ * @brief frameCache Frames recycled by the calling thread
+ *************************************************************************************************/
+static __thread FrameCache_t frameCache;
+
+/**
+ * @brief transferCache Frames handed over between threads, per class
+ *************************************************************************************************/
+static TransferCache_t transferCache[FRAME_CLASSES];
+
+/**
+ * @brief cacheList Registry of the caches of the live threads, walked by the scavenger
+ *************************************************************************************************/
+static FrameCache_t* cacheList = NULL;
+static uint32_t      cacheListLock = 0;
+
+/**
+ * @brief scavengeGeneration Scavenging intervals elapsed, advanced by halloc_frame_scavenge
+ *************************************************************************************************/
+static uint64_t      scavengeGeneration = 0;
+
+/**
+ * @brief scavengedBytes Bytes given back to the heap by scavenging since the process started
+ *************************************************************************************************/
+static uint64_t      scavengedBytes = 0;
+
+/*************************************************************************************************/
+/*********************************** Utilitary functions *****************************************/
+
+/**
+ * @brief toFrameClass Return the frame class index relatively to size informed
+ * @param size         Size of the frame
+ * @return             Frame class index, FRAME_CLASSES or more if it is not recycled
+ *************************************************************************************************/
+static size_t toFrameClass(size_t size)
+{
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    return (size - 1) / FRAME_GRANULARITY;
+}
+
+/**
+ * @brief appendChain Add a chain of frames linked through their first word in front of another
+ * @param chain       Head of the chain added to
+ * @param frames      Chain of frames, may be NULL
+ *************************************************************************************************/
+static void appendChain(void** chain, void* frames)
+{
+    void* tail = frames;
+
+    if (frames == NULL)
+    {
+        return;
+    }
+
+    while (*(void**)tail != NULL)
+    {
+        tail = *(void**)tail;
+    }
+
+    *(void**)tail = *chain;
+    *chain        = frames;
+}
+
+/*************************************************************************************************/
+/*********************************** Transfer cache methods **************************************/
+
+/**
+ * @brief TransferCache_insert Hand a batch of TRANSFER_BATCH frames over to other threads
+ * @param _this                The transfer cache of the frames class
+ * @param batch                Chain of frames
+ * @return                     0 if the batch was inserted, -1 if the cache is full
+ *************************************************************************************************/
+static int TransferCache_insert(TransferCache_t* _this, void* batch)
+{
+    int result = -1;
+
+    spinLock(&_this->lock);
+
+    if (_this->count < TRANSFER_SLOTS)
+    {
+        _this->batches[_this->count++] = batch;
+        result = 0;
+    }
+
+    spinUnlock(&_this->lock);
+
+    return result;
+}
+
+/**
+ * @brief TransferCache_remove Take a batch of TRANSFER_BATCH frames handed over by another thread
+ * @param _this                The transfer cache of the frames class
+ * @return                     Chain of frames or NULL if the cache is empty
+ *************************************************************************************************/
+static void* TransferCache_remove(TransferCache_t* _this)
+{
+    void* batch = NULL;
+
+    // Racy peek, so threads missing their stack do not queue on an empty cache
+    if (__atomic_load_n(&_this->count, __ATOMIC_RELAXED) == 0)
+    {
+        return NULL;
+    }
+
+    spinLock(&_this->lock);
+
+    if (_this->count > 0)
+    {
+        batch = _this->batches[--_this->count];
+
+        if (_this->count < _this->lowWater)
+        {
+            _this->lowWater = _this->count;
+        }
+    }
+
+    spinUnlock(&_this->lock);
+
+    return batch;
+}
+
+/**
+ * @brief TransferCache_trim Give back to the heap the batches no thread took since the last scavenge
+ * @param _this              The transfer cache
+ * @param frameSize          Size of the frames of its class
+ * @return                   Bytes given back to the heap
+ *************************************************************************************************/
+static size_t TransferCache_trim(TransferCache_t* _this, size_t frameSize)
+{
+    void*    batches[TRANSFER_SLOTS];
+    uint32_t i;
+    uint32_t cold;
+
+    spinLock(&_this->lock);
+
+    // The oldest batches are at the bottom
+    cold = _this->lowWater;
+
+    for (i = 0; i < cold; i++)
+    {
+        batches[i] = _this->batches[i];
+    }
+
+    for (i = cold; i < _this->count; i++)
+    {
+        _this->batches[i - cold] = _this->batches[i];
+    }
+
+    _this->count   -= cold;
+    _this->lowWater = _this->count;
+
+    spinUnlock(&_this->lock);
+
+    // Freed without the lock, threads handing batches over do not wait for the heap
+    for (i = 0; i < cold; i++)
+    {
+        halloc_free_batch(batches[i]);
+    }
+
+    return (size_t)cold * TRANSFER_BATCH * frameSize;
+}
+
+/*************************************************************************************************/
+/*********************************** Frame cache methods *****************************************/
+
+/**
+ * @brief FrameCache_trim Detach the frames below the low-water mark of each class. The cache lock
+ *                        must be held; the frames are freed by the caller once it released its locks.
+ * @param _this           The frame cache
+ * @param chain           Chain the frames are added to
+ * @return                Bytes detached
+ *************************************************************************************************/
+static size_t FrameCache_trim(FrameCache_t* _this, void** chain)
+{
+    uint32_t i;
+    size_t   bytes = 0;
+
+    for (i = 0; i < FRAME_CLASSES; i++)
+    {
+        uint32_t keep = _this->count[i] - _this->lowWater[i];
+        void*    cold;
+
+        if (_this->lowWater[i] == 0)
+        {
+            _this->lowWater[i] = _this->count[i];
+            continue;
+        }
+
+        // The unused frames are the bottom of the stack
+        if (keep == 0)
+        {
+            cold             = _this->frames[i];
+            _this->frames[i] = NULL;
+        }
+        else
+        {
+            void*    it = _this->frames[i];
+            uint32_t j;
+
+            for (j = 1; j < keep; j++)
+            {
+                it = *(void**)it;
+            }
+
+            cold        = *(void**)it;
+            *(void**)it = NULL;
+        }
+
+        appendChain(chain, cold);
+
+        bytes               += (size_t)_this->lowWater[i] * (i + 1) * FRAME_GRANULARITY;
+        _this->count[i]      = keep;
+        _this->lowWater[i]   = keep;
+    }
+
+    if (bytes > 0)
+    {
+        __atomic_add_fetch(&scavengedBytes, bytes, __ATOMIC_RELAXED);
+    }
+
+    return bytes;
+}
+
+/**
+ * @brief FrameCache_enter Start an operation of the owner thread on its cache, scavenging it first
+ *                         if a new scavenging interval started
+ * @param _this            The frame cache
+ *************************************************************************************************/
+static void FrameCache_enter(FrameCache_t* _this)
+{
+    uint64_t generation = __atomic_load_n(&scavengeGeneration, __ATOMIC_RELAXED);
+    void*    cold       = NULL;
+
+    spinLock(&_this->lock);
+
+    _this->active = 1;
+
+    if (_this->generation != generation)
+    {
+        _this->generation = generation;
+        FrameCache_trim(_this, &cold);
+    }
+
+    // Freed without the lock, the scavenger skips the cache of an active thread anyway
+    if (cold != NULL)
+    {
+        spinUnlock(&_this->lock);
+        halloc_free_batch(cold);
+        spinLock(&_this->lock);
+    }
+}
+
+/**
+ * @brief FrameCache_detach Detach a batch of the coldest frames of a full stack. The cache lock
+ *                          must be held.
+ * @param _this             The frame cache
+ * @param i                 Frame class index of the stack
+ * @return                  Chain of TRANSFER_BATCH frames
+ *************************************************************************************************/
+static void* FrameCache_detach(FrameCache_t* _this, size_t i)
+{
+    void*    it = _this->frames[i];
+    void*    batch;
+    uint32_t j;
+
+    // The coldest frames are the bottom of the stack
+    for (j = 1; j < FRAME_CACHE_DEPTH - TRANSFER_BATCH; j++)
+    {
+        it = *(void**)it;
+    }
+
+    batch       = *(void**)it;
+    *(void**)it = NULL;
+
+    _this->count[i] = FRAME_CACHE_DEPTH - TRANSFER_BATCH;
+
+    if (_this->count[i] < _this->lowWater[i])
+    {
+        _this->lowWater[i] = _this->count[i];
+    }
+
+    return batch;
+}
+
+/**
+ * @brief FrameCache_release Give all the frames of an exiting thread back to the heap
+ * @param arg                The frame cache
+ *************************************************************************************************/
+static void FrameCache_release(void* arg)
+{
+    FrameCache_t* _this = (FrameCache_t*) arg;
+    uint32_t      i;
+
+    spinLock(&cacheListLock);
+
+    if (_this->previous != NULL) _this->previous->next = _this->next;
+    else                         cacheList             = _this->next;
+
+    if (_this->next != NULL) _this->next->previous = _this->previous;
+
+    spinUnlock(&cacheListLock);
+
+    for (i = 0; i < FRAME_CLASSES; i++)
+    {
+        halloc_free_batch(_this->frames[i]);
+
+        _this->frames[i]   = NULL;
+        _this->count[i]    = 0;
+        _this->lowWater[i] = 0;
+    }
+
+    _this->registered = 0;
+}
+
+/**
+ * @brief FrameCache_register Register the cache of the calling thread in the registry and for
+ *                            release at thread exit
+ * @param _this               The frame cache
+ * @return                    0 if the cache was registered
+ *************************************************************************************************/
+static int FrameCache_register(FrameCache_t* _this)
+{
+    if (libhalloc_thread_exit(FrameCache_release, _this) != 0)
+    {
+        return -1;
+    }
+
+    _this->generation = __atomic_load_n(&scavengeGeneration, __ATOMIC_RELAXED);
+
+    spinLock(&cacheListLock);
+
+    _this->previous = NULL;
+    _this->next     = cacheList;
+
+    if (cacheList != NULL) cacheList->previous = _this;
+
+    cacheList = _this;
+
+    spinUnlock(&cacheListLock);
+
+    _this->registered = 1;
+
+    return 0;
+}
+
+/*************************************************************************************************/
+/*********************************** Public interface functions **********************************/
+
+/**
+ * @brief halloc_frame_alloc
+ * @param size
+ * @return
+ *************************************************************************************************/
+void* halloc_frame_alloc(size_t size)
+{
+    size_t i = toFrameClass(size);
+    void*  frame;
+
+    if (i >= FRAME_CLASSES)
+    {
+        return malloc(size);
+    }
+
+    FrameCache_enter(&frameCache);
+
+    frame = frameCache.frames[i];
+
+    if (frame != NULL)
+    {
+        frameCache.frames[i] = *(void**)frame;
+        frameCache.count[i]--;
+
+        if (frameCache.count[i] < frameCache.lowWater[i])
+        {
+            frameCache.lowWater[i] = frameCache.count[i];
+        }
+    }
+
+    spinUnlock(&frameCache.lock);
+
+    if (frame != NULL)
+    {
+        return frame;
+    }
+
+    frame = TransferCache_remove(&transferCache[i]);
+
+    if (frame == NULL)
+    {
+        // Whole class size, so the frame can be recycled for any size of its class
+        return malloc((i + 1) * FRAME_GRANULARITY);
+    }
+
+    // The rest of the batch refills the stack, which only its owner fills
+    if (frameCache.registered == 0 && FrameCache_register(&frameCache) != 0)
+    {
+        halloc_free_batch(*(void**)frame); // Would be stranded at thread exit
+        return frame;
+    }
+
+    FrameCache_enter(&frameCache);
+
+    frameCache.frames[i] = *(void**)frame;
+    frameCache.count[i]  = TRANSFER_BATCH - 1;
+
+    spinUnlock(&frameCache.lock);
+
+    return frame;
+}
+
+/**
+ * @brief halloc_frame_free
+ * @param ptr
+ * @param size
+ *************************************************************************************************/
+void halloc_frame_free(void* ptr, size_t size)
+{
+    size_t i        = toFrameClass(size);
+    void*  overflow = NULL;
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    if (i >= FRAME_CLASSES)
+    {
+        free(ptr);
+        return;
+    }
+
+    if (frameCache.registered == 0 && FrameCache_register(&frameCache) != 0)
+    {
+        free(ptr); // Would be stranded at thread exit
+        return;
+    }
+
+    FrameCache_enter(&frameCache);
+
+    if (frameCache.count[i] == FRAME_CACHE_DEPTH)
+    {
+        overflow = FrameCache_detach(&frameCache, i);
+    }
+
+    *(void**)ptr         = frameCache.frames[i];
+    frameCache.frames[i] = ptr;
+    frameCache.count[i]++;
+
+    spinUnlock(&frameCache.lock);
+
+    if (overflow != NULL && TransferCache_insert(&transferCache[i], overflow) != 0)
+    {
+        halloc_free_batch(overflow);
+    }
+}
+
+/**
+ * @brief halloc_frame_scavenge
+ * @return
+ *************************************************************************************************/
+size_t halloc_frame_scavenge()
+{
+    FrameCache_t* it;
+    void*         cold  = NULL;
+    size_t        bytes = 0;
+    size_t        idle  = 0;
+    size_t        i;
+
+    __atomic_add_fetch(&scavengeGeneration, 1, __ATOMIC_RELAXED);
+
+    spinLock(&cacheListLock);
+
+    for (it = cacheList; it != NULL; it = it->next)
+    {
+        // Busy caches are being used, so they are not idle
+        if (__atomic_exchange_n(&it->lock, 1, __ATOMIC_ACQUIRE) != 0)
+        {
+            continue;
+        }
+
+        // Active threads trim their own cache at their next operation
+        if (it->active == 0)
+        {
+            idle += FrameCache_trim(it, &cold);
+        }
+
+        it->active = 0;
+
+        spinUnlock(&it->lock);
+    }
+
+    spinUnlock(&cacheListLock);
+
+    // Freed once no spinlock is held, threads registering their cache do not wait for the heap
+    halloc_free_batch(cold);
+
+    // Batches no thread took during the whole interval
+    for (i = 0; i < FRAME_CLASSES; i++)
+    {
+        bytes += TransferCache_trim(&transferCache[i], (i + 1) * FRAME_GRANULARITY);
+    }
+
+    if (bytes > 0)
+    {
+        __atomic_add_fetch(&scavengedBytes, bytes, __ATOMIC_RELAXED);
+    }
+
+    return idle + bytes;
+}
+
+/**
+ * @brief halloc_frame_scavenged
+ * @return
+ *************************************************************************************************/
+size_t halloc_frame_scavenged()
+{
+    return __atomic_load_n(&scavengedBytes, __ATOMIC_RELAXED);
+}
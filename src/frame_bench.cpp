@@ -0,0 +1,100 @@
+/* Coroutine frame benchmark: frames created and destroyed per second with
+ * frames from halloc_frame_alloc versus frames from the global operator new.
+ */
+
+#include <coroutine>
+#include <type_traits>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include "coroutine.hpp"
+
+#define FRAMES_PER_ROUND    64          // Frames alive at the same time
+#define ROUNDS              100000
+
+struct default_allocated
+{
+};
+
+template <bool UseHalloc>
+struct task
+{
+    struct promise_type : std::conditional_t<UseHalloc, halloc::frame_allocated, default_allocated>
+    {
+        task get_return_object()
+        {
+            return task{ std::coroutine_handle<promise_type>::from_promise(*this) };
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::abort(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <bool UseHalloc>
+static task<UseHalloc> small_frame(int value)
+{
+    volatile int local = value;
+    (void)local;
+    co_return;
+}
+
+template <bool UseHalloc>
+static task<UseHalloc> large_frame(int value)
+{
+    volatile char local[512];
+    local[value % sizeof(local)] = (char)value;
+    co_return;
+}
+
+static double elapsed(const struct timespec& start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+template <bool UseHalloc>
+static double frames_per_second()
+{
+    std::coroutine_handle<typename task<UseHalloc>::promise_type> frames[FRAMES_PER_ROUND];
+    struct timespec start;
+    int round;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (round = 0; round < ROUNDS; round++)
+    {
+        for (i = 0; i < FRAMES_PER_ROUND; i++)
+        {
+            frames[i] = (i & 1) ? large_frame<UseHalloc>(i).handle : small_frame<UseHalloc>(i).handle;
+        }
+
+        for (i = 0; i < FRAMES_PER_ROUND; i++)
+        {
+            frames[i].resume();
+            frames[i].destroy();
+        }
+    }
+
+    return (double)ROUNDS * FRAMES_PER_ROUND / elapsed(start);
+}
+
+int main()
+{
+    double defaultRate = frames_per_second<false>();
+    double hallocRate  = frames_per_second<true>();
+
+    printf("%s\n", "coroutine frame benchmark");
+    printf("  operator new      : %.0f frames/s\n", defaultRate);
+    printf("  halloc_frame_alloc: %.0f frames/s (%.2fx)\n", hallocRate, hallocRate / defaultRate);
+
+    return 0;
+}
@@ -1,9 +1,102 @@
+#define _GNU_SOURCE
+
 #include "malloc.h"
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/futex.h>
+
+#define MAX_THREAD_EXIT_CALLBACKS   8               // Callbacks each thread can register to run at its exit
+#define VBUF_COMMIT_STEP            (64 * 1024)     // Bytes growable buffers commit or decommit at least at once
+#define MPOL_PREFERRED_MODE         1               // MPOL_PREFERRED of <numaif.h>, which is not always installed
+#define EXPORT_TEXT_SIZE            (64 * 1024)     // Bytes of the statistics text the exporter serves
+#define EXPORT_POLL_PERIOD          100             // Milliseconds the socket exporter waits for a scrape before checking it should stop
+#define EXPORT_IO_TIMEOUT           1               // Seconds a scraper has to send its request and read the answer
+#define EXPORT_STOPPED              0               // States of the exporter
+#define EXPORT_RUNNING              1
+#define EXPORT_STOPPING             2
+
+typedef struct ThreadExitCallback_s
+{
+    void (*callback)(void*);
+    void* arg;
+
+} ThreadExitCallback_t;
 
 static int page_size = -1;
 
+static int numaNodes = -1;      // NUMA nodes reported to the allocator, -1 until probed
+static int numaFake  = 0;       // Nodes simulated through HALLOC_NUMA_NODES(1), placement is skipped
+
+/**
+ * Recursive so the allocator may be reentered from inside a locked section
+ * (e.g. mallocstats calling printf, which allocates).
+ */
+static pthread_mutex_t heapLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+static pthread_once_t  threadExitKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t   threadExitKey;
+
+static __thread ThreadExitCallback_t threadExitCallbacks[MAX_THREAD_EXIT_CALLBACKS];
+static __thread uint32_t             threadExitCallbacksCount = 0;
+
+/**
+ * The exporter renders into a static buffer and writes with system calls only, so it never
+ * allocates from the heap it reports on.
+ */
+static uint32_t exportState  = EXPORT_STOPPED;
+static int      exportSocket = -1;      // Listening socket, -1 when the exporter rewrites a file
+static uint64_t exportPeriod = 0;       // Nanoseconds between two rewrites of the file
+static char     exportPath[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static char     exportText[EXPORT_TEXT_SIZE];
+
+/** Reserves an address range without backing it with memory. Touching it
+* faults until its pages are committed.
+*
+* \return NULL if the range was not reserved.
+*/
+static void* reservePages(size_t size)
+{
+    void* p = mmap(0, size, PROT_NONE, MAP_PRIVATE|MAP_NORESERVE|MAP_ANONYMOUS, -1, 0);
+
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+/** Makes reserved pages readable and writable.
+*
+* \return 0 if the pages were committed.
+*/
+static int commitPages(void* ptr, size_t size)
+{
+    return mprotect(ptr, size, PROT_READ|PROT_WRITE);
+}
+
+/** Gives the memory of committed pages back to the system and makes them
+* inaccessible again, keeping the address range reserved.
+*
+* \return 0 if the pages were decommitted.
+*/
+static int decommitPages(void* ptr, size_t size)
+{
+    if (madvise(ptr, size, MADV_DONTNEED) != 0)
+    {
+        return -1;
+    }
+
+    return mprotect(ptr, size, PROT_NONE);
+}
+
 /** This function is supposed to lock the memory data structures. It
 * could be as simple as disabling interrupts or acquiring a spinlock.
 * It's up to you to decide.
@@ -13,7 +106,7 @@ static int page_size = -1;
 */
 int libhalloc_lock()
 {
-    return 0;
+    return pthread_mutex_lock(&heapLock);
 }
 
 /** This function unlocks what was previously locked by the liballoc_lock
@@ -24,7 +117,31 @@ int libhalloc_lock()
 */
 int libhalloc_unlock()
 {
-    return 0;
+    return pthread_mutex_unlock(&heapLock);
+}
+
+/** Same as libhalloc_lock, but it must not wait if the memory data
+* structures are locked by another thread.
+*
+* \return 0 if the lock was acquired. Anything else means it is busy.
+*/
+int libhalloc_trylock()
+{
+    return pthread_mutex_trylock(&heapLock);
+}
+
+/** This is the hook into the local system which reads a monotonic clock.
+* It is only called to profile locks which are contended or sampled.
+*
+* \return The current time in nanoseconds.
+*/
+uint64_t libhalloc_clock()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
 }
 
 /** This is the hook into the local system which allocates pages. It
@@ -39,10 +156,10 @@ void* libhalloc_alloc(size_t pages)
     if ( page_size < 0 ) page_size = getpagesize();
     uint32_t size = pages * page_size;
 
-    char *p2 = (char*)mmap(0, size, PROT_NONE, MAP_PRIVATE|MAP_NORESERVE|MAP_ANONYMOUS, -1, 0);
-    if ( p2 == MAP_FAILED) return NULL;
+    char *p2 = reservePages(size);
+    if ( p2 == NULL) return NULL;
 
-    if(mprotect(p2, size, PROT_READ|PROT_WRITE) != 0)
+    if(commitPages(p2, size) != 0)
     {
         munmap(p2, size);
         return NULL;
@@ -63,3 +180,693 @@ int libhalloc_free(void* ptr, size_t pages)
 {
     return munmap( ptr, pages * page_size );
 }
+
+/** Runs, in registration order, the callbacks the exiting thread registered.
+*/
+static void runThreadExitCallbacks(void* value)
+{
+    uint32_t i;
+
+    for (i = 0; i < threadExitCallbacksCount; i++)
+    {
+        threadExitCallbacks[i].callback(threadExitCallbacks[i].arg);
+    }
+
+    threadExitCallbacksCount = 0;
+}
+
+static void createThreadExitKey()
+{
+    pthread_key_create(&threadExitKey, runThreadExitCallbacks);
+}
+
+/** This is the hook into the local system which notifies the allocator
+* that the calling thread is terminating. The callback will be called
+* with arg when the calling thread exits.
+*
+* \return 0 if the callback was registered. Anything else is failure.
+*/
+int libhalloc_thread_exit(void (*callback)(void*), void* arg)
+{
+    if (threadExitCallbacksCount == MAX_THREAD_EXIT_CALLBACKS)
+    {
+        return -1;
+    }
+
+    pthread_once(&threadExitKeyOnce, createThreadExitKey);
+
+    threadExitCallbacks[threadExitCallbacksCount].callback = callback;
+    threadExitCallbacks[threadExitCallbacksCount].arg      = arg;
+    threadExitCallbacksCount++;
+
+    // Any non-NULL value makes the key destructor run at thread exit
+    return pthread_setspecific(threadExitKey, threadExitCallbacks);
+}
+
+/** This is the hook into the local system which starts a background
+* thread of the allocator running routine(arg). Nobody waits for it to
+* finish.
+*
+* \return 0 if the thread was started. Anything else is failure.
+*/
+int libhalloc_thread_start(void* (*routine)(void*), void* arg)
+{
+    pthread_t      thread;
+    pthread_attr_t attr;
+    int            result;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    result = pthread_create(&thread, &attr, routine, arg);
+
+    pthread_attr_destroy(&attr);
+
+    return result;
+}
+
+/** This is the hook into the local system which puts the calling thread
+* to sleep while the word at address holds value, for timeout nanoseconds
+* at most, until libhalloc_wake is called on the same address.
+*
+* \return 0 if the thread was woken up. Anything else means it timed out
+* or did not sleep.
+*/
+int libhalloc_wait(uint32_t* address, uint32_t value, uint64_t timeout)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = timeout / 1000000000ull;
+    ts.tv_nsec = timeout % 1000000000ull;
+
+    return syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, &ts, NULL, 0) == 0 ? 0 : -1;
+}
+
+/** This is the hook into the local system which wakes up every thread
+* sleeping in libhalloc_wait on address.
+*
+* \return 0 if the threads were woken up.
+*/
+int libhalloc_wake(uint32_t* address)
+{
+    return syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0) < 0 ? -1 : 0;
+}
+
+/** Allocates a ring buffer whose pages are mapped twice, back to back, so
+* reads and writes can run past its end and continue at its beginning.
+*
+* \return NULL if the ring buffer was not allocated.
+* \return A pointer to the first mapping of the ring buffer.
+*/
+void* halloc_ring_alloc(size_t size)
+{
+    char* ring;
+    int   fd;
+
+    if ( page_size < 0 ) page_size = getpagesize();
+
+    if (size == 0 || size % page_size != 0)
+    {
+        return NULL;
+    }
+
+    fd = memfd_create("halloc_ring", MFD_CLOEXEC);
+    if ( fd < 0 ) return NULL;
+
+    if (ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // Reserve both halves at once, so nothing else gets mapped between them
+    ring = (char*)mmap(0, size * 2, PROT_NONE, MAP_PRIVATE|MAP_NORESERVE|MAP_ANONYMOUS, -1, 0);
+
+    if ( ring == MAP_FAILED )
+    {
+        close(fd);
+        return NULL;
+    }
+
+    if (mmap(ring,        size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(ring + size, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(ring, size * 2);
+        close(fd);
+        return NULL;
+    }
+
+    // The mappings keep the memory alive
+    close(fd);
+
+    return ring;
+}
+
+/** Frees a ring buffer allocated by halloc_ring_alloc. The size must be the
+* same size given to halloc_ring_alloc.
+*
+* \return 0 if the ring buffer was successfully freed.
+*/
+int halloc_ring_free(void* ring, size_t size)
+{
+    return munmap( ring, size * 2 );
+}
+
+/** Rounds size up to a multiple of the page size.
+*/
+static size_t roundToPages(size_t size)
+{
+    return (size + page_size - 1) / page_size * page_size;
+}
+
+/** Reserves max_bytes of address space for a growable buffer and commits
+* only its header page.
+*
+* \return NULL if the buffer was not created.
+*/
+halloc_vbuf_t* halloc_vbuf_create(size_t max_bytes)
+{
+    halloc_vbuf_t* vbuf;
+    size_t         reserved;
+
+    if ( page_size < 0 ) page_size = getpagesize();
+
+    if (max_bytes == 0)
+    {
+        return NULL;
+    }
+
+    // The header has its own page, so the data starts page aligned
+    reserved = roundToPages(max_bytes);
+    vbuf     = (halloc_vbuf_t*)reservePages(page_size + reserved);
+
+    if (vbuf == NULL)
+    {
+        return NULL;
+    }
+
+    if (commitPages(vbuf, page_size) != 0)
+    {
+        munmap(vbuf, page_size + reserved);
+        return NULL;
+    }
+
+    vbuf->data      = (char*)vbuf + page_size;
+    vbuf->size      = 0;
+    vbuf->committed = 0;
+    vbuf->reserved  = reserved;
+
+    return vbuf;
+}
+
+/** Changes the size of a growable buffer, committing the pages it grows
+* into or decommitting the whole pages it no longer uses. The data never
+* moves.
+*
+* \return 0 if the buffer was resized.
+*/
+int halloc_vbuf_resize(halloc_vbuf_t* vbuf, size_t size)
+{
+    size_t needed;
+
+    if (size > vbuf->reserved)
+    {
+        return -1;
+    }
+
+    needed = roundToPages(size);
+
+    if (needed > vbuf->committed)
+    {
+        // Commit ahead to amortize the system calls over several appends
+        size_t commit = (needed - vbuf->committed < VBUF_COMMIT_STEP) ? vbuf->committed + VBUF_COMMIT_STEP : needed;
+
+        if (commit > vbuf->reserved)
+        {
+            commit = vbuf->reserved;
+        }
+
+        if (commitPages(vbuf->data + vbuf->committed, commit - vbuf->committed) != 0)
+        {
+            return -1;
+        }
+
+        vbuf->committed = commit;
+    }
+    else if (needed + VBUF_COMMIT_STEP <= vbuf->committed)
+    {
+        if (decommitPages(vbuf->data + needed, vbuf->committed - needed) != 0)
+        {
+            return -1;
+        }
+
+        vbuf->committed = needed;
+    }
+
+    vbuf->size = size;
+
+    return 0;
+}
+
+/** Appends length bytes copied from data to a growable buffer.
+*
+* \return NULL if the buffer would grow past its reserved size.
+* \return A pointer to the appended bytes inside the buffer.
+*/
+void* halloc_vbuf_append(halloc_vbuf_t* vbuf, const void* data, size_t length)
+{
+    size_t offset = vbuf->size;
+
+    if (length > vbuf->reserved - offset)
+    {
+        return NULL;
+    }
+
+    if (halloc_vbuf_resize(vbuf, offset + length) != 0)
+    {
+        return NULL;
+    }
+
+    memcpy(vbuf->data + offset, data, length);
+
+    return vbuf->data + offset;
+}
+
+/** Releases a growable buffer and its whole reserved range.
+*
+* \return 0 if the buffer was successfully freed.
+*/
+int halloc_vbuf_destroy(halloc_vbuf_t* vbuf)
+{
+    return munmap( vbuf, page_size + vbuf->reserved );
+}
+
+/** Renders the statistics into exportText, cut after the last whole line
+* if they do not fit.
+*
+* \return The length of the text.
+*/
+static size_t renderStats()
+{
+    size_t length = halloc_stats_prometheus(exportText, sizeof(exportText));
+
+    if (length >= sizeof(exportText))
+    {
+        char* end = memrchr(exportText, '\n', sizeof(exportText) - 1);
+
+        length = (end != NULL) ? (size_t)(end - exportText + 1) : 0;
+    }
+
+    return length;
+}
+
+/** Writes length bytes of data to fd, retrying the partial writes.
+*
+* \return 0 if everything was written.
+*/
+static int writeAll(int fd, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (written <= 0)
+        {
+            return -1;
+        }
+
+        data   += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+/** Replaces the file at exportPath with fresh statistics. They are written
+* to a temporary file renamed over it, so readers never see a partial file.
+*/
+static void writeStatsFile()
+{
+    char   temporary[sizeof(exportPath) + 8];
+    size_t length = renderStats();
+    int    fd;
+
+    snprintf(temporary, sizeof(temporary), "%s.tmp", exportPath);
+
+    fd = open(temporary, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if ( fd < 0 ) return;
+
+    if (writeAll(fd, exportText, length) != 0)
+    {
+        close(fd);
+        unlink(temporary);
+        return;
+    }
+
+    close(fd);
+    rename(temporary, exportPath);
+}
+
+/** Waits for a scrape on the exporter socket and answers it with fresh
+* statistics, as an HTTP response whatever the request was.
+*/
+static void serveScrape()
+{
+    struct pollfd  listener = { exportSocket, POLLIN, 0 };
+    struct timeval timeout  = { EXPORT_IO_TIMEOUT, 0 };
+    char           request[1024];
+    char           header[128];
+    size_t         length;
+    int            client;
+
+    if (poll(&listener, 1, EXPORT_POLL_PERIOD) <= 0)
+    {
+        return;
+    }
+
+    client = accept4(exportSocket, NULL, NULL, SOCK_CLOEXEC);
+    if ( client < 0 ) return;
+
+    // A scraper which stalls can only hold the exporter for the timeout
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (read(client, request, sizeof(request)) >= 0)
+    {
+        length = renderStats();
+
+        snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", length);
+
+        if (writeAll(client, header, strlen(header)) == 0)
+        {
+            writeAll(client, exportText, length);
+        }
+    }
+
+    close(client);
+}
+
+/** Body of the exporter thread.
+*/
+static void* runExporter(void* arg)
+{
+    while (__atomic_load_n(&exportState, __ATOMIC_ACQUIRE) == EXPORT_RUNNING)
+    {
+        if (exportSocket >= 0)
+        {
+            serveScrape();
+        }
+        else
+        {
+            writeStatsFile();
+            libhalloc_wait(&exportState, EXPORT_RUNNING, exportPeriod);
+        }
+    }
+
+    if (exportSocket >= 0)
+    {
+        close(exportSocket);
+        unlink(exportPath);
+        exportSocket = -1;
+    }
+
+    __atomic_store_n(&exportState, EXPORT_STOPPED, __ATOMIC_RELEASE);
+    libhalloc_wake(&exportState);
+
+    return NULL;
+}
+
+/** Creates the listening UNIX socket of the exporter at exportPath,
+* replacing any socket file left there.
+*
+* \return The socket, -1 if it was not created.
+*/
+static int openExportSocket()
+{
+    struct sockaddr_un address;
+    int                fd;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, exportPath);
+
+    fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if ( fd < 0 ) return -1;
+
+    unlink(exportPath);
+
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 8) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/** Starts the exporter thread, serving the statistics on a UNIX socket or
+* rewriting a file every period milliseconds.
+*
+* \return 0 if the exporter runs, -1 if it could not be started.
+*/
+int halloc_export_start(const char* path, int mode, uint32_t period)
+{
+    uint32_t state = EXPORT_STOPPED;
+
+    if (path == NULL || strlen(path) >= sizeof(exportPath) || (mode != HALLOC_EXPORT_FILE && mode != HALLOC_EXPORT_SOCKET))
+    {
+        return -1;
+    }
+
+    // Only one exporter at a time
+    if (!__atomic_compare_exchange_n(&exportState, &state, EXPORT_RUNNING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        return -1;
+    }
+
+    strcpy(exportPath, path);
+    exportPeriod = (uint64_t)((period > 0) ? period : 1000) * 1000000ull;
+    exportSocket = (mode == HALLOC_EXPORT_SOCKET) ? openExportSocket() : -1;
+
+    if ((mode == HALLOC_EXPORT_SOCKET && exportSocket < 0) || libhalloc_thread_start(runExporter, NULL) != 0)
+    {
+        if (exportSocket >= 0)
+        {
+            close(exportSocket);
+            unlink(exportPath);
+            exportSocket = -1;
+        }
+
+        __atomic_store_n(&exportState, EXPORT_STOPPED, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    return 0;
+}
+
+/** Stops the exporter thread and removes its socket. It returns once the
+* exporter is done.
+*/
+void halloc_export_stop()
+{
+    uint32_t state = EXPORT_RUNNING;
+
+    if (!__atomic_compare_exchange_n(&exportState, &state, EXPORT_STOPPING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+        state != EXPORT_STOPPING)
+    {
+        return;
+    }
+
+    libhalloc_wake(&exportState);
+
+    while (__atomic_load_n(&exportState, __ATOMIC_ACQUIRE) == EXPORT_STOPPING)
+    {
+        libhalloc_wait(&exportState, EXPORT_STOPPING, EXPORT_POLL_PERIOD * 1000000ull);
+    }
+}
+
+/** Appends value in decimal and a separator to line, without the help of
+* printf, which is not safe in signal handlers.
+*/
+static void appendUnsigned(char* line, size_t* length, uint64_t value, char separator)
+{
+    char   digits[20];
+    size_t count = 0;
+
+    do
+    {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    }
+    while (value != 0);
+
+    while (count > 0)
+    {
+        line[(*length)++] = digits[--count];
+    }
+
+    line[(*length)++] = separator;
+}
+
+/** Writes the statistics history to fd, one sample per line.
+*
+* \return 0 if the history was written, -1 on a write error or while
+* another dump runs.
+*/
+int halloc_history_dump(int fd)
+{
+    static const char              header[] = "# age_ms mapped_bytes active_bytes fragmentation_permille blocks maps_per_second\n";
+    static halloc_history_sample_t samples[HALLOC_HISTORY_SAMPLES];
+    static uint32_t                dumping  = 0;
+    uint64_t                       now      = libhalloc_clock();
+    size_t                         count;
+    size_t                         i;
+    int                            result;
+
+    // The samples are copied to a static buffer, which one dump uses at a time
+    if (__atomic_exchange_n(&dumping, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        return -1;
+    }
+
+    count  = halloc_history_read(samples, HALLOC_HISTORY_SAMPLES);
+    result = writeAll(fd, header, sizeof(header) - 1);
+
+    for (i = 0; i < count && result == 0; i++)
+    {
+        char   line[128];
+        size_t length = 0;
+
+        appendUnsigned(line, &length, (now > samples[i].time) ? (now - samples[i].time) / 1000000 : 0, ' ');
+        appendUnsigned(line, &length, samples[i].mapped,        ' ');
+        appendUnsigned(line, &length, samples[i].active,        ' ');
+        appendUnsigned(line, &length, samples[i].fragmentation, ' ');
+        appendUnsigned(line, &length, samples[i].blocks,        ' ');
+        appendUnsigned(line, &length, samples[i].mapsPerSecond, '\n');
+
+        result = writeAll(fd, line, length);
+    }
+
+    __atomic_store_n(&dumping, 0, __ATOMIC_RELEASE);
+
+    return result;
+}
+
+/** Reads the highest online NUMA node from sysfs, without allocating.
+*
+* \return The number of NUMA nodes, 1 if it can not be known.
+*/
+static int readOnlineNodes()
+{
+    char    text[128];
+    ssize_t length;
+    ssize_t i;
+    int     number  = 0;
+    int     highest = 0;
+    int     fd      = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+
+    if ( fd < 0 ) return 1;
+
+    length = read(fd, text, sizeof(text));
+    close(fd);
+
+    // A list of ranges, e.g. "0-1,3"
+    for (i = 0; i < length; i++)
+    {
+        if (text[i] >= '0' && text[i] <= '9')
+        {
+            number = number * 10 + (text[i] - '0');
+            continue;
+        }
+
+        if (number > highest) highest = number;
+        number = 0;
+    }
+
+    if (number > highest) highest = number;
+
+    return highest + 1;
+}
+
+/** This is the hook into the local system which tells how many NUMA nodes
+* the allocator should keep arenas for. Setting HALLOC_NUMA_NODES in the
+* environment simulates that many nodes on any machine: threads are spread
+* over them by thread id and no placement policy is applied.
+*
+* \return The number of NUMA nodes.
+*/
+uint32_t libhalloc_numa_nodes()
+{
+    if ( numaNodes < 0 )
+    {
+        const char* fake = getenv("HALLOC_NUMA_NODES");
+
+        if (fake != NULL && atoi(fake) > 0)
+        {
+            numaFake  = 1;
+            numaNodes = atoi(fake);
+        }
+        else
+        {
+            numaNodes = readOnlineNodes();
+        }
+    }
+
+    return numaNodes;
+}
+
+/** This is the hook into the local system which tells on which NUMA node
+* the calling thread is running.
+*
+* \return The NUMA node of the calling thread.
+*/
+uint32_t libhalloc_numa_node()
+{
+    unsigned int cpu;
+    unsigned int node;
+
+    if ( numaFake ) return (uint32_t)syscall(SYS_gettid) % numaNodes;
+
+    if (getcpu(&cpu, &node) != 0)
+    {
+        return 0;
+    }
+
+    return node;
+}
+
+/** Same as libhalloc_alloc, but the pages are placed on the given NUMA node
+* when possible. The policy is set before the pages are touched.
+*
+* \return NULL if the pages were not allocated.
+* \return A pointer to the allocated memory.
+*/
+void* libhalloc_alloc_node(size_t pages, uint32_t node)
+{
+    if ( page_size < 0 ) page_size = getpagesize();
+    size_t size = pages * page_size;
+
+    char *p2 = reservePages(size);
+    if ( p2 == NULL) return NULL;
+
+    if ( !numaFake && node < sizeof(unsigned long) * 8 )
+    {
+        unsigned long nodeMask = 1UL << node;
+
+        // Preferred rather than bound: when the node is full, memory elsewhere beats failing
+        syscall(SYS_mbind, p2, size, MPOL_PREFERRED_MODE, &nodeMask, sizeof(nodeMask) * 8, 0);
+    }
+
+    if(commitPages(p2, size) != 0)
+    {
+        munmap(p2, size);
+        return NULL;
+    }
+
+    return p2;
+}
@@ -1,6 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "malloc.h"
 
 extern int malloc_random_test( int verbose );
@@ -178,6 +182,964 @@ int test_malloc_free_coallesce_leftright(int size)
     return 0;
 }
 
+int test_epoch_retire(int count)
+{
+    void*  var[64];
+    size_t freed = 0;
+    int    i;
+
+    printf("test_epoch_retire(%d)\n", count);
+
+    assert(count <= 64);
+
+    halloc_epoch_enter();
+
+    for (i=0; i<count; i++)
+    {
+        var[i] = malloc(32);
+        assert(var[i] != NULL);
+        halloc_retire(var[i]);
+    }
+
+    // Still inside the region which could see them
+    assert(halloc_epoch_collect() == 0);
+
+    halloc_epoch_leave();
+
+    for (i=0; i<3 && freed < count; i++)
+    {
+        freed += halloc_epoch_collect();
+    }
+
+    assert(freed == count);
+
+    return 0;
+}
+
+int test_frame_recycle(int size)
+{
+    void* frame;
+    void* recycled;
+
+    printf("test_frame_recycle(%d)\n", size);
+
+    frame = halloc_frame_alloc(size);
+    assert(frame != NULL);
+    assert(((uintptr_t)frame & 15) == 0);
+    memset(frame, 0, size);
+
+    halloc_frame_free(frame, size);
+
+    // Same class: the frame just freed is reused
+    recycled = halloc_frame_alloc(size - 1);
+    assert(recycled == frame);
+    memset(recycled, 0, size - 1);
+
+    halloc_frame_free(recycled, size - 1);
+
+    return 0;
+}
+
+int test_frame_scavenge(int size)
+{
+    void*  frames[8];
+    size_t scavenged = halloc_frame_scavenged();
+    int    i;
+
+    printf("test_frame_scavenge(%d)\n", size);
+
+    for (i=0; i<8; i++)
+    {
+        frames[i] = halloc_frame_alloc(size);
+        assert(frames[i] != NULL);
+    }
+
+    for (i=0; i<8; i++)
+    {
+        halloc_frame_free(frames[i], size);
+    }
+
+    // The first interval only sets the low-water marks, the frames stay
+    // unused during the second one and are given back in the third
+    halloc_frame_scavenge();
+    halloc_frame_scavenge();
+    assert(halloc_frame_scavenge() >= 8 * (size_t)size);
+    assert(halloc_frame_scavenged() - scavenged >= 8 * (size_t)size);
+
+    // The cache still works once emptied
+    frames[0] = halloc_frame_alloc(size);
+    assert(frames[0] != NULL);
+    halloc_frame_free(frames[0], size);
+
+    return 0;
+}
+
+int test_frame_transfer(int size)
+{
+    void* freed[96];
+    void* frames[64];
+    void* batched;
+    int   found = 0;
+    int   i;
+
+    printf("test_frame_transfer(%d)\n", size);
+
+    for (i=0; i<96; i++)
+    {
+        freed[i] = halloc_frame_alloc(size);
+        assert(freed[i] != NULL);
+    }
+
+    // The stack overflows, its 32 coldest frames go to the transfer cache
+    for (i=0; i<96; i++)
+    {
+        halloc_frame_free(freed[i], size);
+    }
+
+    for (i=0; i<64; i++)
+    {
+        frames[i] = halloc_frame_alloc(size);
+    }
+
+    // The stack is empty, a batch of frames freed earlier refills it
+    batched = halloc_frame_alloc(size);
+
+    for (i=0; i<96; i++)
+    {
+        found |= (freed[i] == batched);
+    }
+
+    assert(found);
+
+    for (i=0; i<64; i++)
+    {
+        assert(frames[i] != batched);
+        halloc_frame_free(frames[i], size);
+    }
+
+    halloc_frame_free(batched, size);
+
+    return 0;
+}
+
+static halloc_site_stats_t sitesBefore[HALLOC_CALL_SITES];
+
+/* Returns the index of a call site tag in the table, or of the return address
+ * site which made one allocation since sitesBefore was read when name is NULL */
+static int findSite(const char* name)
+{
+    halloc_site_stats_t stats;
+    int                 i;
+
+    for (i=0; i<HALLOC_CALL_SITES; i++)
+    {
+        if (halloc_site_stats(i, &stats) != 0)
+        {
+            continue;
+        }
+
+        if (name != NULL ? (stats.name != NULL && strcmp(stats.name, name) == 0)
+                         : (stats.name == NULL && stats.count == sitesBefore[i].count + 1))
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int test_malloc_site(int size)
+{
+    halloc_site_stats_t stats;
+    const char*         siteA;
+    const char*         siteB;
+    int*                var[4];
+    int                 index[3];
+    uint64_t            peak[3];
+    int                 i;
+
+    printf("test_malloc_site(%d)\n", size);
+
+    for (i=0; i<HALLOC_CALL_SITES; i++)
+    {
+        if (halloc_site_stats(i, &sitesBefore[i]) != 0)
+        {
+            memset(&sitesBefore[i], 0, sizeof(halloc_site_stats_t));
+        }
+    }
+
+    for (i=0; i<2; i++)
+    {
+        var[i] = halloc_malloc_here(size); siteA = HALLOC_SITE;
+    }
+
+    var[2] = halloc_malloc_here(size); siteB = HALLOC_SITE;
+    var[3] = halloc_malloc_site(size, NULL);
+
+    for (i=0; i<4; i++)
+    {
+        assert(var[i] != NULL);
+        assert(((uintptr_t)var[i] & 15) == 0);
+        memset(var[i], 0xff, size);
+    }
+
+    index[0] = findSite(siteA);
+    index[1] = findSite(siteB);
+    index[2] = findSite(NULL);
+    assert(index[0] >= 0 && index[1] >= 0 && index[2] >= 0);
+
+    for (i=0; i<3; i++)
+    {
+        uint64_t allocated = (i == 0) ? 2 : 1;
+
+        assert(halloc_site_stats(index[i], &stats) == 0);
+        assert(stats.count - sitesBefore[index[i]].count == allocated);
+        assert(stats.liveBytes == allocated * size);
+        assert(stats.peakBytes >= allocated * size);
+        peak[i] = stats.peakBytes;
+    }
+
+    for (i=0; i<4; i++)
+    {
+        free(var[i]);
+    }
+
+    // Nothing is live anymore, the high-water mark stays
+    for (i=0; i<3; i++)
+    {
+        assert(halloc_site_stats(index[i], &stats) == 0);
+        assert(stats.liveBytes == 0);
+        assert(stats.peakBytes == peak[i]);
+    }
+
+    return 0;
+}
+
+typedef struct iterate_ctx_s
+{
+    void*  wanted[3];
+    int    found;
+    int    regions;
+    char*  nextAddress; // Where the next region of the same block must begin
+    void*  block;
+
+} iterate_ctx_t;
+
+static int iterate_callback(const halloc_region_t* region, void* ctx)
+{
+    iterate_ctx_t* it = (iterate_ctx_t*) ctx;
+    int            i;
+
+    // Regions of a block are contiguous: a payload plus header and footer, if any
+    if (region->block == it->block)
+    {
+        assert((char*)region->address == it->nextAddress);
+    }
+
+    it->block       = region->block;
+    it->nextAddress = (char*)region->address + region->size + region->overhead;
+    it->regions++;
+
+    for (i=0; i<3; i++)
+    {
+        if (region->address == it->wanted[i])
+        {
+            assert(region->state == HALLOC_REGION_USED);
+            assert(region->size >= 100);
+            it->found++;
+        }
+    }
+
+    return 0;
+}
+
+int test_heap_iterate()
+{
+    iterate_ctx_t ctx;
+    int           i;
+
+    printf("test_heap_iterate\n");
+
+    memset(&ctx, 0, sizeof(ctx));
+
+    for (i=0; i<3; i++)
+    {
+        ctx.wanted[i] = malloc(100);
+        assert(ctx.wanted[i] != NULL);
+    }
+
+    assert(halloc_iterate(iterate_callback, &ctx) == 0);
+    assert(ctx.found == 3);
+    assert(ctx.regions > 3);
+
+    for (i=0; i<3; i++)
+    {
+        free(ctx.wanted[i]);
+    }
+
+    return 0;
+}
+
+static int count_tagged_callback(const halloc_region_t* region, void* ctx)
+{
+    if (region->tag == 0x5e55 && region->state == HALLOC_REGION_USED)
+    {
+        (*(int*)ctx)++;
+    }
+
+    return 0;
+}
+
+int test_malloc_tagged(int count)
+{
+    int*  var[64];
+    int*  untagged;
+    int   tagged = 0;
+    int   i;
+
+    printf("test_malloc_tagged(%d)\n", count);
+
+    assert(count <= 64);
+
+    untagged = malloc(sizeof(int));
+    assert(untagged != NULL);
+    *untagged = 42;
+
+    for (i=0; i<count; i++)
+    {
+        var[i] = halloc_malloc_tagged(0x5e55, 100);
+        assert(var[i] != NULL);
+        assert(((uintptr_t)var[i] & 15) == 0);
+        memset(var[i], 0, 100);
+    }
+
+    free(var[0]); // One by one still works
+
+    assert(halloc_iterate(count_tagged_callback, &tagged) == 0);
+    assert(tagged == count - 1);
+
+    assert(halloc_free_tag(0x5e55) >= 1);
+
+    tagged = 0;
+    assert(halloc_iterate(count_tagged_callback, &tagged) == 0);
+    assert(tagged == 0);
+
+    assert(*untagged == 42);
+    free(untagged);
+
+    return 0;
+}
+
+int test_malloc_near(int size)
+{
+    char* var[8];
+    char* hole;
+    char* near;
+    int   i;
+
+    printf("test_malloc_near(%d)\n", size);
+
+    for (i=0; i<8; i++)
+    {
+        var[i] = malloc(size);
+        assert(var[i] != NULL);
+    }
+
+    hole = var[4];
+    free(var[4]);
+
+    // The hole left next to the hint is the one used
+    near = halloc_malloc_near(var[3], size);
+    assert(near == hole);
+    memset(near, 0, size);
+    var[4] = near;
+
+    // No hint, or a hint out of the heap, is a plain malloc
+    near = halloc_malloc_near(NULL, size);
+    assert(near != NULL);
+    free(near);
+
+    near = halloc_malloc_near(&i, size);
+    assert(near != NULL);
+    free(near);
+
+    for (i=0; i<8; i++)
+    {
+        free(var[i]);
+    }
+
+    return 0;
+}
+
+int test_malloc_streams(int size)
+{
+    char* nodes[64];
+    char* records[64];
+    int   samePage = 0;
+    int   i;
+
+    printf("test_malloc_streams(%d)\n", size);
+
+    halloc_set_streams(HALLOC_MAX_STREAMS);
+
+    // Two call sites, each following the previous allocation of its stream
+    for (i=0; i<64; i++)
+    {
+        nodes[i]   = malloc(size);
+        records[i] = malloc(size);
+        assert(nodes[i] != NULL && records[i] != NULL);
+        memset(nodes[i], i, size);
+        memset(records[i], i, size);
+
+        samePage += (i > 0 && (uintptr_t)nodes[i] / 4096 == (uintptr_t)nodes[i-1] / 4096);
+    }
+
+    assert(samePage >= 32);
+
+    for (i=0; i<64; i++)
+    {
+        assert(nodes[i][size-1] == (char)i);
+        free(records[i]);
+        free(nodes[i]);
+    }
+
+    halloc_set_streams(0);
+
+    return 0;
+}
+
+int test_zero_pool(int size)
+{
+    char* var;
+    int   i;
+    int   j;
+
+    printf("test_zero_pool(%d)\n", size);
+
+    assert(halloc_background_start() == 0);
+
+    // Freed dirty, each region comes back zeroed by calloc or by the worker
+    for (i=0; i<16; i++)
+    {
+        var = calloc(1, size);
+        assert(var != NULL);
+
+        for (j=0; j<size; j++)
+        {
+            assert(var[j] == 0);
+        }
+
+        memset(var, 0xa5, size);
+        free(var);
+    }
+
+    halloc_background_stop();
+
+    return 0;
+}
+
+/* Returns the sum of the samples of a counter over the arenas, read from the
+ * Prometheus text */
+static unsigned long long arenaCounter(const char* name)
+{
+    static char        text[65536];
+    unsigned long long total = 0;
+    size_t             length = strlen(name);
+    char*              line;
+
+    assert(halloc_stats_prometheus(text, sizeof(text)) < sizeof(text));
+
+    for (line = text; line != NULL && *line != '\0'; line = strchr(line, '\n'), line = (line != NULL) ? line + 1 : NULL)
+    {
+        if (strncmp(line, name, length) == 0 && line[length] == '{')
+        {
+            total += strtoull(strchr(line, ' ') + 1, NULL, 10);
+        }
+    }
+
+    return total;
+}
+
+int test_block_reserve(int count)
+{
+    unsigned long long hits;
+    char*              var[64];
+    char*              small[300];
+    char*              big;
+    int                i;
+
+    printf("test_block_reserve(%d)\n", count);
+
+    assert(count <= 64);
+    assert(halloc_background_start() == 0);
+
+    // The worker fills the reserves once started
+    for (i=0; i<200 && arenaCounter("halloc_arena_reserve_mappings") == 0; i++)
+    {
+        usleep(10000);
+    }
+
+    hits = arenaCounter("halloc_arena_reserve_maps_total");
+
+    // New blocks are taken from the reserve when one is ready
+    for (i=0; i<count; i++)
+    {
+        var[i] = malloc(6000);
+        assert(var[i] != NULL);
+        memset(var[i], i, 6000);
+    }
+
+    assert(arenaCounter("halloc_arena_reserve_maps_total") > hits);
+
+    for (i=0; i<count; i++)
+    {
+        assert(var[i][0] == (char)i && var[i][5999] == (char)i);
+        free(var[i]);
+    }
+
+    // The mappings of the released blocks are reused by blocks of the other layout
+    for (i=0; i<300; i++)
+    {
+        small[i] = malloc(512);
+        assert(small[i] != NULL);
+    }
+
+    for (i=0; i<300; i++)
+    {
+        free(small[i]);
+    }
+
+    big = malloc(62000);
+    assert(big != NULL);
+    memset(big, 0xab, 62000);
+
+    for (i=0; i<300; i++)
+    {
+        small[i] = malloc(512);
+        assert(small[i] != NULL);
+        memset(small[i], 0x5a, 512);
+    }
+
+    for (i=0; i<62000; i++)
+    {
+        assert(big[i] == (char)0xab);
+    }
+
+    for (i=0; i<300; i++)
+    {
+        free(small[i]);
+    }
+
+    free(big);
+
+    halloc_background_stop();
+
+    return 0;
+}
+
+int test_mallinfo(int size)
+{
+    struct mallinfo2 before;
+    struct mallinfo2 during;
+    struct mallinfo2 after;
+    char             xml[4096];
+    FILE*            stream;
+    char*            var;
+
+    printf("test_mallinfo(%d)\n", size);
+
+    before = mallinfo2();
+    var    = malloc(size);
+    assert(var != NULL);
+    during = mallinfo2();
+
+    assert(during.uordblks >= before.uordblks + size);
+    assert(during.uordblks + during.fordblks <= during.arena);
+
+    free(var);
+    after = mallinfo2();
+
+    assert(after.uordblks == before.uordblks);
+    assert(after.fordblks <= after.arena);
+
+    stream = fmemopen(xml, sizeof(xml), "w");
+    assert(stream != NULL);
+    assert(malloc_info(0, stream) == 0);
+    assert(malloc_info(1, stream) == -1);
+    fclose(stream);
+
+    assert(strncmp(xml, "<malloc version=\"1\">", 20) == 0);
+    assert(strstr(xml, "<total type=\"rest\"") != NULL);
+    assert(strstr(xml, "</malloc>") != NULL);
+
+    return 0;
+}
+
+int test_stats_export()
+{
+    static char        text[65536];
+    const char*        file       = "/tmp/halloc_test_stats.prom";
+    const char*        socketPath = "/tmp/halloc_test_stats.sock";
+    const char         request[]  = "GET /metrics HTTP/1.0\r\n\r\n";
+    struct sockaddr_un address;
+    char               small[16];
+    size_t             length;
+    ssize_t            received;
+    FILE*              stream;
+    int                fd;
+    int                i;
+
+    printf("test_stats_export\n");
+
+    length = halloc_stats_prometheus(small, sizeof(small));
+    assert(length >= sizeof(small));
+    assert(strlen(small) == sizeof(small) - 1);
+
+    length = halloc_stats_prometheus(text, sizeof(text));
+    assert(length < sizeof(text) && strlen(text) == length);
+    assert(strstr(text, "# TYPE halloc_arena_mapped_bytes gauge\n") != NULL);
+    assert(strstr(text, "halloc_lock_hold_seconds_bucket{lock=\"heap\",le=\"+Inf\"}") != NULL);
+
+    // The file is replaced every 10 ms
+    unlink(file);
+    assert(halloc_export_start(file, HALLOC_EXPORT_FILE, 10) == 0);
+    assert(halloc_export_start(file, HALLOC_EXPORT_FILE, 10) == -1);
+
+    for (i = 0; i < 200 && access(file, R_OK) != 0; i++)
+    {
+        usleep(10000);
+    }
+
+    stream = fopen(file, "r");
+    assert(stream != NULL);
+    length = fread(text, 1, sizeof(text) - 1, stream);
+    text[length] = '\0';
+    fclose(stream);
+    assert(strstr(text, "halloc_arena_used_bytes{arena=\"0\"") != NULL);
+
+    halloc_export_stop();
+    unlink(file);
+
+    // Each connection gets an HTTP response
+    assert(halloc_export_start(socketPath, HALLOC_EXPORT_SOCKET, 0) == 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    assert(connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0);
+    assert(write(fd, request, sizeof(request) - 1) == sizeof(request) - 1);
+
+    length = 0;
+
+    while ((received = read(fd, text + length, sizeof(text) - 1 - length)) > 0)
+    {
+        length += received;
+    }
+
+    text[length] = '\0';
+    close(fd);
+
+    assert(strncmp(text, "HTTP/1.0 200 OK\r\n", 17) == 0);
+    assert(strstr(text, "halloc_arena_free_regions{arena=\"0\"") != NULL);
+
+    halloc_export_stop();
+    assert(access(socketPath, F_OK) != 0);
+
+    return 0;
+}
+
+int test_stats_history(int count)
+{
+    halloc_history_sample_t samples[8];
+    char                    text[4096];
+    char*                   var[64];
+    size_t                  taken;
+    ssize_t                 length;
+    int                     pipes[2];
+    int                     i;
+
+    printf("test_stats_history(%d)\n", count);
+
+    assert(count <= 64);
+
+    halloc_history_interval(1);
+    assert(halloc_background_start() == 0);
+
+    // The heap grows while the worker records it
+    for (i=0; i<count; i++)
+    {
+        var[i] = malloc(6000);
+        assert(var[i] != NULL);
+        usleep(1000);
+    }
+
+    usleep(50000);
+
+    taken = halloc_history_read(samples, 8);
+    assert(taken == 8);
+
+    for (i=1; i<8; i++)
+    {
+        assert(samples[i].time > samples[i-1].time);
+        assert(samples[i].mapped > 0 && samples[i].blocks > 0);
+        assert(samples[i].fragmentation <= 1000);
+    }
+
+    // About a hundred samples, which fit in the pipe
+    assert(pipe(pipes) == 0);
+    assert(halloc_history_dump(pipes[1]) == 0);
+    close(pipes[1]);
+
+    length = read(pipes[0], text, sizeof(text) - 1);
+    assert(length > 0);
+    text[length] = '\0';
+    close(pipes[0]);
+
+    assert(strncmp(text, "# age_ms mapped_bytes", 21) == 0);
+    assert(strchr(text, '\n')[1] >= '0' && strchr(text, '\n')[1] <= '9');
+
+    halloc_history_interval(0);
+    halloc_background_stop();
+
+    for (i=0; i<count; i++)
+    {
+        free(var[i]);
+    }
+
+    return 0;
+}
+
+typedef struct HookCounts_s
+{
+    int   allocs;
+    int   frees;
+    int   reallocs;
+    int   maps;
+    int   unmaps;
+    void* last;
+
+} HookCounts_t;
+
+static void countAlloc(void* ptr, size_t size, void* ctx)
+{
+    HookCounts_t* counts = ctx;
+
+    counts->allocs++;
+    counts->last = ptr;
+
+    free(malloc(size)); // Not reported
+}
+
+static void countFree(void* ptr, void* ctx)
+{
+    ((HookCounts_t*)ctx)->frees++;
+}
+
+static void countRealloc(void* old, void* ptr, size_t size, void* ctx)
+{
+    ((HookCounts_t*)ctx)->reallocs++;
+}
+
+static void countMap(void* block, size_t size, void* ctx)
+{
+    ((HookCounts_t*)ctx)->maps++;
+}
+
+static void countUnmap(void* block, size_t size, void* ctx)
+{
+    ((HookCounts_t*)ctx)->unmaps++;
+}
+
+int test_alloc_hooks(int size)
+{
+    static HookCounts_t   counts;
+    static halloc_hooks_t hooks = { countAlloc, countFree, countRealloc, countMap, countUnmap, &counts };
+    char*                 var;
+    int                   i;
+
+    printf("test_alloc_hooks(%d)\n", size);
+
+    memset(&counts, 0, sizeof(counts));
+    halloc_set_hooks(&hooks);
+
+    // Big enough for a heap block of its own
+    var = malloc(size);
+    assert(var != NULL);
+    assert(counts.allocs == 1 && counts.last == var);
+    assert(counts.maps >= 1);
+
+    var = realloc(var, size * 2);
+    assert(var != NULL);
+    assert(counts.allocs == 1 && counts.frees == 0 && counts.reallocs == 1);
+
+    free(var);
+    assert(counts.frees == 1);
+    assert(counts.unmaps >= 1);
+
+    // More than a thread keeps before reporting them
+    for (i=0; i<40; i++)
+    {
+        assert(halloc_malloc_tagged(0x400c, 100) != NULL);
+    }
+
+    assert(halloc_free_tag(0x400c) >= 1);
+    assert(counts.allocs == 41 && counts.frees == 41);
+
+    halloc_set_hooks(NULL);
+
+    free(malloc(size));
+    assert(counts.allocs == 41 && counts.frees == 41);
+
+    return 0;
+}
+
+int test_thread_stats(int size)
+{
+    const halloc_thread_stats_t* stats = halloc_thread_stats();
+    uint64_t                     allocated;
+    uint64_t                     deallocated;
+    char*                        var;
+    int                          i;
+
+    printf("test_thread_stats(%d)\n", size);
+
+    assert(stats == halloc_thread_stats());
+
+    allocated   = stats->allocated;
+    deallocated = stats->deallocated;
+
+    var = malloc(size);
+    assert(var != NULL);
+    assert(stats->allocated - allocated >= (uint64_t)size);
+    assert(stats->deallocated == deallocated);
+
+    free(var);
+    assert(stats->deallocated - deallocated == stats->allocated - allocated);
+
+    allocated   = stats->allocated;
+    deallocated = stats->deallocated;
+
+    for (i=0; i<10; i++)
+    {
+        assert(halloc_malloc_tagged(0x5747, size) != NULL);
+    }
+
+    assert(stats->allocated - allocated >= 10 * (uint64_t)size);
+
+    assert(halloc_free_tag(0x5747) >= 1);
+    assert(stats->deallocated - deallocated == stats->allocated - allocated);
+
+    return 0;
+}
+
+int test_vbuf_grow_shrink()
+{
+    halloc_vbuf_t* vbuf;
+    char           chunk[1000];
+    char*          data;
+    int            i;
+
+    printf("test_vbuf_grow_shrink\n");
+
+    vbuf = halloc_vbuf_create(1024*1024);
+    assert(vbuf != NULL);
+    assert(((uintptr_t)vbuf->data & 4095) == 0);
+
+    data = vbuf->data;
+
+    for (i=0; i<500; i++)
+    {
+        memset(chunk, i & 0xff, sizeof(chunk));
+        assert(halloc_vbuf_append(vbuf, chunk, sizeof(chunk)) == data + i*sizeof(chunk));
+    }
+
+    assert(vbuf->data == data);   // Never moves
+    assert(vbuf->size == 500*sizeof(chunk));
+    assert(vbuf->committed >= vbuf->size);
+    assert(data[499*sizeof(chunk)] == (char)(499 & 0xff));
+
+    // Past the reserved range
+    assert(halloc_vbuf_resize(vbuf, 2*1024*1024) != 0);
+
+    assert(halloc_vbuf_resize(vbuf, 1000) == 0);
+    assert(vbuf->committed < 500*sizeof(chunk));
+    assert(data[999] == 0);
+
+    assert(halloc_vbuf_destroy(vbuf) == 0);
+
+    return 0;
+}
+
+static int find_region_callback(const halloc_region_t* region, void* ctx)
+{
+    halloc_region_t* wanted = (halloc_region_t*) ctx;
+
+    if (region->address == wanted->address)
+    {
+        *wanted = *region;
+        return 1;
+    }
+
+    return 0;
+}
+
+int test_numa_arena()
+{
+    halloc_region_t region;
+    uint32_t        nodes = libhalloc_numa_nodes();
+
+    printf("test_numa_arena (%d nodes)\n", nodes);
+
+    region.address = malloc(64);
+    assert(region.address != NULL);
+
+    // Placed in the arena of the node the thread runs on (8 arenas at most)
+    assert(halloc_iterate(find_region_callback, &region) == 1);
+    assert(region.node == libhalloc_numa_node() % (nodes > 8 ? 8 : nodes));
+
+    free(region.address);
+
+    return 0;
+}
+
+int test_lock_stats()
+{
+    halloc_lock_stats_t stats;
+    uint64_t before = 0;
+    uint64_t after  = 0;
+    uint32_t i;
+    void* var;
+
+    printf("test_lock_stats\n");
+
+    // The heap lock, or the arena and block locks in fine-grained mode
+    for (i=0; i<HALLOC_LOCK_CLASSES; i++)
+    {
+        assert(halloc_lock_stats(i, &stats) == 0);
+        before += stats.acquisitions;
+    }
+
+    var = malloc(64);
+    assert(var != NULL);
+    free(var);
+
+    for (i=0; i<HALLOC_LOCK_CLASSES; i++)
+    {
+        assert(halloc_lock_stats(i, &stats) == 0);
+        assert(stats.contended <= stats.acquisitions);
+        after += stats.acquisitions;
+    }
+
+    assert(after >= before + 2);
+
+    assert(halloc_lock_stats(HALLOC_LOCK_CLASSES, &stats) == -1);
+
+    return 0;
+}
+
 int main( int argc, char *argv )
 {
     int verbose = argc > 1;
@@ -195,6 +1157,38 @@ int main( int argc, char *argv )
     test_malloc_free_coallesce_right(4096);
     test_malloc_free_coallesce_leftright(4096);
 
+    test_epoch_retire(16);
+
+    test_frame_recycle(100);
+    test_frame_scavenge(128);
+    test_frame_transfer(1000);
+
+    test_malloc_site(64);
+
+    test_heap_iterate();
+    test_malloc_tagged(50);
+    test_malloc_near(64);
+    test_malloc_streams(48);
+
+    test_zero_pool(20000);
+    test_block_reserve(32);
+
+    test_mallinfo(1000);
+
+    test_stats_export();
+
+    test_stats_history(32);
+
+    test_alloc_hooks(100000);
+    test_thread_stats(24);
+    test_thread_stats(100000);
+
+    test_vbuf_grow_shrink();
+
+    test_numa_arena();
+
+    test_lock_stats();
+
     malloc_random_test( verbose );
 
     mallocstats();
@@ -1,20 +1,57 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdint.h>
 #include <stddef.h>
 #include "malloc.h"
+#include "spinlock.h"
+#ifdef HALLOC_SIZE_CLASSES_HEADER
+#include HALLOC_SIZE_CLASSES_HEADER                             // Classes fitted by size_classes
+#else
+#include "size_classes.h"
+#endif
 
 /*************************************************************************************************/
 /*********************************** Constants definitions ***************************************/
 
 #define MINIMUM_REGION_SIZE         16                          // Each region contains at least 16 bytes
 #define PAGE_SIZE                   4096                        // x86 page size in bytes
-#define FREE_BLOCKS_SETS            6                           /* How many sets of free blocks we want.
-                                                                 * Starting in >= 16 and <=32 bytes */
+#define TAGGED_BLOCK_SIZE           (PAGE_SIZE*4)               // Minimum size of the blocks dedicated to a tag
+#define MAX_ARENAS                  8                           // NUMA nodes with an arena of their own, the others share them
+#define RECENT_BLOCKS               4                           // Blocks most recently freed into, tried first by each arena
+#define FREE_BLOCKS_SETS            HALLOC_SIZE_CLASSES         // How many sets of free blocks we want, see size_classes.h
 #define LARGE_FREE_BLOCK_INDEX      FREE_BLOCKS_SETS-1          // Index of the last set of free blocks
 #define REGION_OVERHEAD_SIZE        (sizeof(AllocMetadata_t)*2) // 8 bytes of overhead (region's size headers)
 #define REGION_PAYLOAD_SIZE(x)      (x-REGION_OVERHEAD_SIZE)    // How much payload (data+padding) this region holds
 #define PAYLOAD_WITH_OVERHEAD(x)    (x+REGION_OVERHEAD_SIZE)    // Total size of this allocation
+#define REGION_TRACKED              2                           // "used" flag of regions accounted to a call site
+#define CALL_SITE_CLAIMED           ((const void*)1)            // Key of a call site entry whose name is being stored
+#define CALL_SITES                  HALLOC_CALL_SITES           /* Call sites accounted (power of two). The last one
+                                                                 * gathers the sites which did not fit */
+#define LOCK_HOLD_SAMPLING          64                          // Uncontended acquisitions per hold time sample (power of two)
+#define ARENA_LOCK_WRITER           0x80000000u                 // Arena lock held exclusively, the low bits count the readers
+#define ARENA_LOCK_PENDING          0x40000000u                 // A thread waits for the arena lock exclusively, readers hold back
+#define ZERO_POOL_MIN_SIZE          (PAGE_SIZE*4)               // Smallest calloc served by the pre-zeroed pool
+#define ZERO_POOL_CLASSES           8                           // Size classes of the pool, doubling from ZERO_POOL_MIN_SIZE
+#define ZERO_POOL_DEPTH             4                           // Most zeroed regions kept ready in each class
+#define RESERVE_PAGES               16                          // Pages of the mappings kept in reserve for new blocks
+#define RESERVE_BLOCKS              4                           // Mappings the background worker keeps in reserve per arena
+#define RESERVE_LOW_WATER           2                           // Below it, taking a mapping wakes the worker up
+#define BACKGROUND_PERIOD           10000000                    // Nanoseconds the background worker sleeps when not woken up
+#define BACKGROUND_STOPPED          0                           // States of the background worker
+#define BACKGROUND_RUNNING          1
+#define BACKGROUND_STOPPING         2
+#define DENSE_BLOCK_SIZE            (PAGE_SIZE*16)              // Size of the blocks keeping the region state out of band
+#define DENSE_GRANULE               16                          // Allocation unit of those blocks, one bit of each bitmap
+#define DENSE_MAX_SIZE              512                         // Largest payload placed in those blocks
+#define DENSE_WORDS                 (DENSE_BLOCK_SIZE/DENSE_GRANULE/64)                         // Words of each bitmap
+#define DENSE_DATA_OFFSET           ((sizeof(BlockHeader_t)+sizeof(DenseTable_t)+15) & ~15)     // First payload of a dense block
+#define DENSE_GRANULES              ((DENSE_BLOCK_SIZE-DENSE_DATA_OFFSET)/DENSE_GRANULE)        // Granules of a dense block
+#define HOOK_PENDING_EVENTS         16                          // Events a thread holds until it leaves the allocator
+#define HOOK_EVENT_UNMAP            0                           // Kinds of the events held
+#define HOOK_EVENT_MAP              1
+#define HOOK_EVENT_FREE             2
+#define ARENA_COUNTER(field)        offsetof(Arena_t, field), sizeof(((Arena_t*)0)->field)     // Offset and size of a counter of the arenas
 
 /*************************************************************************************************/
 /*********************************** Structs definitions *****************************************/
@@ -25,7 +62,7 @@
  *************************************************************************************************/
 typedef struct AllocMetadata_s
 {
-    uint32_t used: 4;   // Used to know if this region is alocated(1) or free(0)
+    uint32_t used: 4;   // Used to know if this region is alocated(1) or free(0), plus REGION_TRACKED
     uint32_t size: 28;  // Size of this region
 
 } AllocMetadata_t; // 4 bytes
@@ -54,30 +91,308 @@ typedef struct BlockHeader_s
     uint32_t pages;                 // Pages allocated from the system
     uint32_t size;                  // Total size allocated from the system
     uint32_t usedSize;              // Size allocated to the client
+#ifdef HALLOC_FINE_GRAINED_LOCKS
+    uint32_t lock;                  // Held to allocate from or free to this block
+#endif
+#ifdef HALLOC_OUT_OF_BAND_METADATA
+    uint32_t dense;                 // Regions have no boundary tags, their state is in the DenseTable_t after the header
+#endif
+    uintptr_t tag;                  // Tag of the allocations this block is dedicated to, 0 if untagged
+    struct Arena_s* arena;          // Arena holding this block
     struct BlockHeader_s* next;     // Next block given from OS
     struct BlockHeader_s* previous; // Previous block given from OS
 
-    FreeRegionHeader_t* freeRegions[FREE_BLOCKS_SETS];  /* >=16 and <=32 (8 to 24 bytes payload),  *
-                                                       * <=64          (60 bytes payload),       *
-                                                       * <=128         (120 bytes payload),      *
-                                                       * <=256         (248 bytes payload),      *
-                                                       * <=512         (504 bytes payload),      *
-                                                       * > 512         (504 bytes payload)       */
-} BlockHeader_t; // 44 bytes (32 bits) / 80 aligned bytes (64 bits)
+    FreeRegionHeader_t* freeRegions[FREE_BLOCKS_SETS];  /* Free regions up to each limit of freeListLimits, *
+                                                       * the last list holds the larger ones              */
+} BlockHeader_t; // 52 bytes (32 bits) / 96 aligned bytes (64 bits)
+
+/**
+ * Side table following the header of a dense block. Its payloads sit back to back after it, in
+ * granules of DENSE_GRANULE bytes: an allocation is a run of used granules, the first of which is
+ * marked in starts, and free regions are the runs of granules not used. Freed granules need no
+ * coalescing, and the search for a free region reads the bitmaps only.
+ *************************************************************************************************/
+typedef struct DenseTable_s
+{
+    uint64_t used[DENSE_WORDS];     // Bit set for each granule allocated, and those past the end of the block
+    uint64_t starts[DENSE_WORDS];   // Bit set for the first granule of each allocation
+    uint32_t firstFree;             // No granule before it is free, searches start there
+    uint32_t missingRun;            // Free granules known not to be found in a row since the last free, 0 if unknown
+
+} DenseTable_t; // 1032 bytes
+
+/**
+ * The blocks placed on one NUMA node. Each thread allocates from the arena of the node it runs on.
+ *************************************************************************************************/
+typedef struct Arena_s
+{
+    BlockHeader_t* blockList;       // Blocks of this arena, by address
+    BlockHeader_t* recent[RECENT_BLOCKS]; // Blocks most recently freed into or added, most recent first
+    uint32_t       node;            // NUMA node the blocks are placed on
+    uint32_t       blocks;          // Blocks in blockList
+    size_t         size;            // Total size allocated from the system
+    size_t         peakSize;        // Highest size allocated from the system
+    size_t         usedSize;        // Used size of the blocks, block headers included
+    size_t         freeCount[FREE_BLOCKS_SETS]; // Free regions in each class of the free lists
+    size_t         freeSize[FREE_BLOCKS_SETS];  // Bytes of the free regions in each class
+    size_t         denseFree;       // Bytes of the free granules of the dense blocks
+    void*          reserve[RESERVE_BLOCKS]; // Mappings of RESERVE_PAGES ready for new blocks, pages faulted in
+    uint32_t       reserveCount;    // Mappings in reserve
+    uint32_t       reserveLock;     // Held for a few instructions to use the reserve
+    uint64_t       reserveHits;     // New blocks which took a mapping from the reserve
+    uint64_t       syncMaps;        // New blocks for which an allocating thread mapped pages itself
+#ifdef HALLOC_FINE_GRAINED_LOCKS
+    uint32_t       lock;            // Shared to use the blocks, exclusive to add or release blocks
+    uint64_t       holdStart;       // When the lock was taken exclusively, if its hold time is sampled
+#endif
+
+} Arena_t;
+
+/**
+ * Trailer stored at the end of the payload of the regions accounted to a call site, right
+ * before the region footer.
+ *************************************************************************************************/
+typedef struct CallSiteTrailer_s
+{
+    uint32_t site;  // Index of the call site in the call site table
+    uint32_t size;  // Size requested by user
+
+} CallSiteTrailer_t; // 8 bytes
+
+/**
+ * Allocation counters of a call site. Entries are claimed and updated with atomic operations,
+ * so accounting never takes the heap lock.
+ *************************************************************************************************/
+typedef struct CallSite_s
+{
+    const void* key;        // Call site tag or return address, NULL if the entry is not claimed, CALL_SITE_CLAIMED
+                            // until its name is stored
+    const char* name;       // Call site tag, NULL if keyed by return address
+    uint64_t    count;      // Allocations made
+    uint64_t    liveBytes;  // Bytes requested and not freed yet
+    uint64_t    peakBytes;  // Highest liveBytes seen
+
+} CallSite_t;
+
+/**
+ * Contention counters of a class of locks. Counters are updated with atomic operations, since
+ * the locks of a class may be held by different threads at the same time.
+ *************************************************************************************************/
+typedef struct LockProfile_s
+{
+    uint64_t acquisitions;                          // Times a lock of the class was acquired
+    uint64_t contended;                             // Acquisitions which had to wait
+    uint64_t waitTotal;                             // Nanoseconds spent waiting
+    uint64_t waitMax;                               // Longest wait in nanoseconds
+    uint64_t holdHistogram[HALLOC_LOCK_HISTOGRAM];  // Sampled hold times, bucket i holds 2^i ns and up
+
+} LockProfile_t;
+
+/**
+ * Zeroed allocations of a size class, kept ready for calloc by the background worker.
+ *************************************************************************************************/
+typedef struct ZeroClass_s
+{
+    uint32_t lock;                      // Held for a few instructions to use the class
+    uint32_t count;                     // Regions in ready
+    uint32_t wanted;                    // Regions the worker keeps ready, raised by each miss
+    uint32_t pending;                   // Regions freed to the class, waiting in dirtyRegions to be zeroed
+    void*    ready[ZERO_POOL_DEPTH];    // Allocations of at least the class size, zeroed up to it
+    uint64_t hits;                      // calloc calls served from the class
+    uint64_t misses;                    // calloc calls which found the class empty
+
+} ZeroClass_t;
+
+/**
+ * Text written into a buffer given by the caller. Once the buffer is full the text is only counted,
+ * so the caller learns the size it needs.
+ *************************************************************************************************/
+typedef struct TextBuffer_s
+{
+    char*  data;    // Buffer, always terminated when it is not empty
+    size_t size;    // Size of the buffer
+    size_t length;  // Length of the text, including what did not fit
+
+} TextBuffer_t;
+
+/**
+ * Slot of the statistics history. Its sequence is odd while the background worker writes the
+ * sample, and 2 * (index + 1) once sample number index is complete, so readers which take no lock
+ * can tell a torn or overwritten sample.
+ *************************************************************************************************/
+typedef struct HistorySlot_s
+{
+    uint64_t                sequence;
+    halloc_history_sample_t sample;
+
+} HistorySlot_t;
+
+/**
+ * Heap block mapped or unmapped, or allocation freed with its block, while the allocator held its
+ * locks, reported to the hooks once the thread released them.
+ *************************************************************************************************/
+typedef struct HookEvent_s
+{
+    void*    address;   // Start of the heap block, or the allocation
+    size_t   size;      // Size of the heap block
+    uint32_t kind;      // One of the HOOK_EVENT_* values
+
+} HookEvent_t;
+
+/**
+ * Progress of halloc_free_tag through the allocations of a block, which it reports a few at a time.
+ *************************************************************************************************/
+typedef struct HookFreeWalk_s
+{
+    BlockHeader_t* block;   // Block being walked
+    uintptr_t      resume;  // First allocation of the block not reported yet
+
+} HookFreeWalk_t;
 
 /*************************************************************************************************/
 /*********************************** Global variables ********************************************/
 
 /**
- * @brief firstBlock First block of memory catch from the kernel
+ * @brief arenas One arena per NUMA node, up to MAX_ARENAS
+ *************************************************************************************************/
+static Arena_t        arenas[MAX_ARENAS];
+
+/**
+ * @brief arenaCount Arenas in use, 0 until the first allocation
+ *************************************************************************************************/
+static uint32_t       arenaCount = 0;
+
+/**
+ * @brief freeListLimits Largest region size of each free list class
  *************************************************************************************************/
-static BlockHeader_t* blockList = NULL;
+static const uint32_t freeListLimits[FREE_BLOCKS_SETS] = { HALLOC_SIZE_CLASS_LIMITS, UINT32_MAX };
 
 /**
  * @brief blockEmptySize Size of overhead (BlockHeader_t + Alignment) in a empty BlockHeader_t
  *************************************************************************************************/
 static uint32_t       emptyBlockOverheadSize = 0;
 
+/**
+ * @brief callSites Lock-free open addressing table of the call sites accounted
+ *************************************************************************************************/
+static CallSite_t     callSites[CALL_SITES];
+
+/**
+ * @brief lockProfiles Contention counters of each class of locks
+ *************************************************************************************************/
+static LockProfile_t  lockProfiles[HALLOC_LOCK_CLASSES];
+
+/**
+ * @brief zeroClasses Pre-zeroed pool, one class per size doubling from ZERO_POOL_MIN_SIZE
+ *************************************************************************************************/
+static ZeroClass_t    zeroClasses[ZERO_POOL_CLASSES];
+
+/**
+ * @brief dirtyRegions Large allocations freed while the pool wanted them, chained through their first
+ *                     word, waiting for the background worker to zero them
+ *************************************************************************************************/
+static void*          dirtyRegions = NULL;
+
+/**
+ * @brief mapCalls Calls made to map pages for heap blocks, whether they went to a block or a reserve
+ *************************************************************************************************/
+static uint64_t       mapCalls = 0;
+
+/**
+ * @brief historySlots Ring of the samples of the statistics history
+ *************************************************************************************************/
+static HistorySlot_t  historySlots[HALLOC_HISTORY_SAMPLES];
+
+/**
+ * @brief historyWritten Samples written since the start, the next one goes to its slot modulo the ring
+ *************************************************************************************************/
+static uint64_t       historyWritten = 0;
+
+/**
+ * @brief historyInterval Nanoseconds between two samples of the history, 0 if it is not recorded
+ *************************************************************************************************/
+static uint64_t       historyInterval = 0;
+
+/**
+ * @brief historyLast When the last sample was taken and the map calls made then, background worker only
+ *************************************************************************************************/
+static uint64_t       historyLast     = 0;
+static uint64_t       historyLastMaps = 0;
+
+/**
+ * @brief backgroundState One of the BACKGROUND_* values
+ *************************************************************************************************/
+static uint32_t       backgroundState = BACKGROUND_STOPPED;
+
+/**
+ * @brief backgroundSignal Changed to wake the background worker up before its period ends
+ *************************************************************************************************/
+static uint32_t       backgroundSignal = 0;
+
+/**
+ * @brief backgroundThread Set in the background worker, whose frees are never deferred to itself
+ *************************************************************************************************/
+static __thread uint32_t backgroundThread = 0;
+
+/**
+ * @brief hookTable Hooks called on allocation events, NULL if none are set
+ *************************************************************************************************/
+static const halloc_hooks_t* hookTable = NULL;
+
+/**
+ * @brief hookDepth Set while the calling thread runs a hook, whose own allocations are not reported
+ *************************************************************************************************/
+static __thread uint32_t hookDepth = 0;
+
+/**
+ * @brief pendingEvents Events of the calling thread waiting for it to release its locks
+ *************************************************************************************************/
+static __thread HookEvent_t pendingEvents[HOOK_PENDING_EVENTS];
+static __thread uint32_t    pendingEventCount = 0;
+
+/**
+ * @brief threadStats Bytes allocated and freed by the calling thread, see halloc_thread_stats
+ *************************************************************************************************/
+static __thread halloc_thread_stats_t threadStats = { 0, 0 };
+
+/**
+ * @brief streamCount Allocation streams malloc spreads its call sites over, 0 if they are not used
+ *************************************************************************************************/
+static uint32_t       streamCount = 0;
+
+/**
+ * @brief streamCursors Last allocation of each stream in the calling thread, next to which the
+ *                      following one is placed. Only a hint, it may have been freed since.
+ *************************************************************************************************/
+static __thread void* streamCursors[HALLOC_MAX_STREAMS];
+
+#ifndef HALLOC_FINE_GRAINED_LOCKS
+
+/**
+ * @brief heapLockDepth Nesting of the heap lock, only touched by the thread holding it
+ *************************************************************************************************/
+static uint32_t       heapLockDepth = 0;
+
+/**
+ * @brief heapLockHoldStart When the heap lock was acquired if its hold time is sampled, 0 otherwise
+ *************************************************************************************************/
+static uint64_t       heapLockHoldStart = 0;
+
+#else
+
+/**
+ * @brief heapLockDepth Nesting of the heap lock in the calling thread. While it holds it, the thread
+ *                      holds every arena exclusively and takes no other lock.
+ *************************************************************************************************/
+static __thread uint32_t heapLockDepth = 0;
+
+/**
+ * @brief blockHoldStart When the calling thread locked its block if its hold time is sampled
+ *************************************************************************************************/
+static __thread uint64_t blockHoldStart = 0;
+
+#endif
+
 /*************************************************************************************************/
 /*********************************** Methods prototypes ******************************************/
 
@@ -85,7 +400,7 @@ static FreeRegionHeader_t* FreeRegion_create             (void* start, size_t si
 static FreeRegionHeader_t* FreeRegion_split              (FreeRegionHeader_t* original, size_t size);
 static size_t              FreeRegion_getSizeForAlignment(FreeRegionHeader_t* original, size_t size);
 
-static BlockHeader_t*      Block_create(size_t size);
+static BlockHeader_t*      Block_create(Arena_t* arena, size_t size);
 
 static uint32_t            Block_isFreeRegion            (BlockHeader_t* _this, AllocMetadata_t* addr);
 static void                Block_coallesceBothSides      (BlockHeader_t* _this, AllocMetadata_t* left, FreeRegionHeader_t* reference, AllocMetadata_t* right);
@@ -98,12 +413,46 @@ static AllocMetadata_t*    Block_useRegion               (BlockHeader_t* _this,
 static FreeRegionHeader_t* Block_freeRegion              (BlockHeader_t* _this, AllocMetadata_t* region);
 static uint32_t            Block_isFull                  (BlockHeader_t* _this);
 static FreeRegionHeader_t* Block_canAllocateSize         (BlockHeader_t* _this, uint32_t size);
+static FreeRegionHeader_t* Block_getNearestFreeRegion    (BlockHeader_t* _this, uint32_t size, void* hint);
+static AllocMetadata_t*    Block_allocateFreeRegion      (BlockHeader_t* _this, FreeRegionHeader_t* freeRegion, uint32_t regionSize);
 static AllocMetadata_t*    Block_allocateRegion          (BlockHeader_t* _this, size_t size);
+static AllocMetadata_t*    Block_allocateRegionNear      (BlockHeader_t* _this, size_t size, void* hint);
 static void Block_deallocateRegion(BlockHeader_t* _this, AllocMetadata_t* region);
 
 static uint32_t            BlockList_addBlockToList      (BlockHeader_t **list, BlockHeader_t* item);
 static uint32_t            BlockList_removeBlockFromList (BlockHeader_t** list, BlockHeader_t* item);
 
+static void                Arena_touchBlock              (Arena_t* _this, BlockHeader_t* block);
+static void*               Arena_mapPages                (Arena_t* _this, size_t* pages);
+static void                Arena_unmapPages              (Arena_t* _this, void* memory, size_t pages);
+static void                Arena_lockShared              (Arena_t* _this);
+static void                Arena_unlockShared            (Arena_t* _this);
+static void                Arena_lockExclusive           (Arena_t* _this);
+static void                Arena_unlockExclusive         (Arena_t* _this);
+static void                Arena_downgrade               (Arena_t* _this);
+static uint32_t            Block_tryLock                 (BlockHeader_t* _this);
+static void                Block_lock                    (BlockHeader_t* _this);
+static void                Block_unlock                  (BlockHeader_t* _this);
+static void                Block_unlockWithArena         (BlockHeader_t* _this);
+
+static void                Background_wake               ();
+static void                Hooks_blockEvent              (BlockHeader_t* block, uint32_t mapped);
+static void                Hooks_flush                   ();
+static void*               ZeroPool_take                 (size_t size);
+static uint32_t            ZeroPool_recycle              (void* pointer, size_t payloadSize);
+
+static uint32_t            isDenseSize                   (size_t size);
+static size_t              getPayloadSize                (void* pointer);
+static uint32_t            Block_isDense                 (BlockHeader_t* _this);
+static BlockHeader_t*      DenseBlock_create             (Arena_t* arena);
+static uint32_t            DenseBlock_canAllocateSize    (BlockHeader_t* _this, size_t size);
+static void*               DenseBlock_allocateRegion     (BlockHeader_t* _this, size_t size, void* hint);
+static void                DenseBlock_deallocateRegion   (BlockHeader_t* _this, void* pointer);
+#ifdef HALLOC_OUT_OF_BAND_METADATA
+static size_t              DenseBlock_getPayloadSize     (BlockHeader_t* _this, void* pointer);
+#endif
+static int                 DenseBlock_iterate            (BlockHeader_t* _this, halloc_iterate_callback_t callback, void* ctx);
+
 /*************************************************************************************************/
 /*********************************** Utilitary functions *****************************************/
 
@@ -115,184 +464,573 @@ static uint32_t            BlockList_removeBlockFromList (BlockHeader_t** list,
 static uint32_t toFreeListIndex(size_t size)
 {
     uint32_t s = size;
+    uint32_t i = 0;
 
-    if (s <= 32) return 0;
-    if (s <= 64) return 1;
-    if (s <= 128) return 2;
-    if (s <= 256) return 3;
-    if (s <= 512) return 4;
+    while (s > freeListLimits[i]) // The last limit takes any size
+    {
+        i++;
+    }
 
-    return 5; // if (s > 512)
+    return i;
 }
 
 /**
- * @brief InitializeHeap Setup a new heap block for first use
- * @param size           Size of the block
- * @return               New heap block
+ * @brief counterAdd Add to a counter of an arena. In fine-grained mode the threads using different
+ *                   blocks of an arena update its counters at the same time.
+ * @param counter    The counter
+ * @param delta      Value added, negated with -(size_t) to subtract
  *************************************************************************************************/
-static BlockHeader_t* createHeapBlock(size_t size)
+static void counterAdd(size_t* counter, size_t delta)
 {
-    BlockHeader_t*   block;
-    size_t alignRegionSize = (sizeof(uintptr_t)*2); /* Free block payload (next and prev pointers) */
+#ifdef HALLOC_FINE_GRAINED_LOCKS
+    __atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+#else
+    *counter += delta;
+#endif
+}
+
+/**
+ * @brief getArena Return the arena of the NUMA node the calling thread runs on
+ * @return         The arena
+ *************************************************************************************************/
+static Arena_t* getArena()
+{
+    uint32_t count = __atomic_load_n(&arenaCount, __ATOMIC_ACQUIRE);
+
+    // Threads racing to set the arenas up all write the same values
+    if (count == 0)
+    {
+        uint32_t i;
+        uint32_t nodes = libhalloc_numa_nodes();
+
+        for (i = 0; i < MAX_ARENAS; i++)
+        {
+            arenas[i].node = i;
+        }
 
-    block = Block_create(size);
+        count = (nodes == 0) ? 1 : (nodes > MAX_ARENAS) ? MAX_ARENAS : nodes;
 
-    // Create First Block for alignment
-    Block_allocateRegion(block, alignRegionSize);
+        __atomic_store_n(&arenaCount, count, __ATOMIC_RELEASE);
+    }
 
-    return block;
+    if (count == 1)
+    {
+        return &arenas[0];
+    }
+
+    return &arenas[libhalloc_numa_node() % count];
 }
 
 /**
- * @brief getBlockWithFreeRegion Search for a block with a free region with can hold a payload of
- *                               informed size
- * @param size                   Size of the payload user requested
- * @return                       A block with a free region or NULL
+ * @brief Arena_addBlock Add a new heap block to the arena
+ * @param _this          The arena
+ * @param block          The block to be added
  *************************************************************************************************/
-static BlockHeader_t* getBlockWithFreeRegion(size_t size)
+static void Arena_addBlock(Arena_t* _this, BlockHeader_t* block)
 {
-    BlockHeader_t* block = NULL;
+    if (block == NULL)
+    {
+        return;
+    }
+
+    BlockList_addBlockToList(&_this->blockList, block);
+    Arena_touchBlock(_this, block);
 
-    if (blockList == NULL)
+    _this->blocks++;
+    _this->size += block->size;
+
+    if (_this->size > _this->peakSize)
     {
-        block = createHeapBlock(PAGE_SIZE*4);
-        BlockList_addBlockToList(&blockList, block);
-        emptyBlockOverheadSize = block->usedSize;
-        return block;
+        _this->peakSize = _this->size;
     }
 
-    // Search for a block with free regions to use
-    for(block = blockList;
-        (block != NULL);
-        block = block->next)
+    if (__atomic_load_n(&hookTable, __ATOMIC_RELAXED) != NULL)
     {
-        if (!Block_isFull(block) && Block_canAllocateSize(block, size))
-        {
-            return block;
-        }
+        Hooks_blockEvent(block, 1);
     }
+}
 
-    if (block == NULL)
+/**
+ * @brief Arena_touchBlock Move a block to the front of the blocks most recently freed into, which
+ *                         allocations try before the others. In fine-grained mode it is called with
+ *                         the arena shared, so other threads may move blocks at the same time: an
+ *                         entry can be lost or doubled, but every entry is a block of the arena.
+ * @param _this            The arena
+ * @param block            The block
+ *************************************************************************************************/
+static void Arena_touchBlock(Arena_t* _this, BlockHeader_t* block)
+{
+    BlockHeader_t* moved = block;
+    uint32_t       i;
+
+    if (__atomic_load_n(&_this->recent[0], __ATOMIC_RELAXED) == block)
     {
-        // Allocate a new block
-        block = createHeapBlock(size);
-        BlockList_addBlockToList(&blockList, block);
-        return block;
+        return;
     }
 
-    return NULL;
+    // Shift the more recent entries down, up to the one the block leaves
+    for (i = 0; i < RECENT_BLOCKS && moved != NULL; i++)
+    {
+        BlockHeader_t* current = __atomic_load_n(&_this->recent[i], __ATOMIC_RELAXED);
+
+        __atomic_store_n(&_this->recent[i], moved, __ATOMIC_RELAXED);
+
+        moved = (current == block) ? NULL : current;
+    }
 }
 
 /**
- * @brief getBlockWithRegion Using the address informed, search for a heap block which contains it.
- * @param region             Region address to be searched
- * @return                   The heap block which contains it or null
+ * @brief Arena_hasBlock Informs if a block is still in the arena, without touching the block
+ * @param _this          The arena
+ * @param block          The block to be searched
+ * @return               True(1) or false(0)
  *************************************************************************************************/
-static BlockHeader_t* getBlockWithRegion(void* region)
+static uint32_t Arena_hasBlock(Arena_t* _this, BlockHeader_t* block)
 {
-    BlockHeader_t* block;
+    BlockHeader_t* it;
 
-    // Search for a block with free regions to use
-    for(block = blockList;
-        block != NULL;
-        block = block->next)
+    for (it = _this->blockList; it != NULL; it = it->next)
     {
-        uintptr_t regionAddr     = (uintptr_t)region;
-        uintptr_t blockStartAddr = (uintptr_t)block;
-        uintptr_t blockEndAddr   = blockStartAddr + block->size;
-
-        if (regionAddr >= blockStartAddr && regionAddr < blockEndAddr)
+        if (it == block)
         {
-            return block;
+            return 1;
         }
     }
 
-    return NULL;
+    return 0;
 }
 
 /**
- * @brief BlockList_addBlockToList Add a block heap to the block heap linked list
- * @param list                     The block heap linked list
- * @param item                     The item to be added
- * @return
+ * @brief Arena_releaseBlock Remove a heap block from the arena and give it back to the kernel
+ * @param _this              The arena
+ * @param block              The block to be released
  *************************************************************************************************/
-static uint32_t BlockList_addBlockToList(BlockHeader_t** list, BlockHeader_t* item)
+static void Arena_releaseBlock(Arena_t* _this, BlockHeader_t* block)
 {
-    BlockHeader_t* aux = *list;
+    uint32_t i;
 
-    if (item == NULL)
+    BlockList_removeBlockFromList(&_this->blockList, block);
+
+    for (i = 0; i < RECENT_BLOCKS; i++)
     {
-        return 0;
+        if (_this->recent[i] == block)
+        {
+            _this->recent[i] = NULL;
+        }
     }
 
-    if (*list == NULL)
+    _this->blocks--;
+    _this->size -= block->size;
+
+    // Take what is left in the block out of the counters
+    counterAdd(&_this->usedSize, -(size_t)block->usedSize);
+
+    if (Block_isDense(block))
     {
-        item->next     = NULL;
-        item->previous = NULL;
-        *list = item;
-        return 0;
+        counterAdd(&_this->denseFree, -(size_t)(DENSE_DATA_OFFSET + DENSE_GRANULES * DENSE_GRANULE - block->usedSize));
     }
 
-    if (*list > item)
+    for (i = 0; i < FREE_BLOCKS_SETS; i++)
     {
-        item->next     = *list;
-        item->previous = NULL;
-        (*list)->previous = item;
-        *list = item;
-        return 0;
+        FreeRegionHeader_t* it;
+
+        for (it = block->freeRegions[i]; it != NULL; it = it->next)
+        {
+            counterAdd(&_this->freeCount[i], -(size_t)1);
+            counterAdd(&_this->freeSize[i],  -(size_t)it->metadata.size);
+        }
     }
 
-    // Get the last item in list
-    // Order by region address
-    while ((aux->next != NULL) && (item < aux->next))
+    if (__atomic_load_n(&hookTable, __ATOMIC_RELAXED) != NULL)
     {
-        aux = aux->next;
+        Hooks_blockEvent(block, 0);
     }
 
-    item->next     = aux->next;
-    item->previous = aux;
-    aux->next      = item;
-
-    return 0;
+    Arena_unmapPages(_this, block, block->pages);
 }
 
 /**
- * @brief BlockList_removeBlockFromList Remove a block heap to the block heap linked list
- * @param list                          The block heap linked list
- * @param item                          The item to be removed
- * @return
+ * @brief Arena_mapPages Get the pages of a new block of the arena: a mapping of the reserve if the
+ *                       block fits in it, otherwise pages mapped by the calling thread
+ * @param _this          The arena, its pages are placed on the arena node
+ * @param pages          Pages wanted, updated with the pages given
+ * @return               The pages or NULL
  *************************************************************************************************/
-static uint32_t BlockList_removeBlockFromList(BlockHeader_t** list, BlockHeader_t* item)
+static void* Arena_mapPages(Arena_t* _this, size_t* pages)
 {
-    BlockHeader_t* aux;
+    void*    memory = NULL;
+    uint32_t low    = 0;
 
-    if (item == NULL)
+    if (*pages <= RESERVE_PAGES)
     {
-        return -1;
+        spinLock(&_this->reserveLock);
+
+        if (_this->reserveCount > 0)
+        {
+            memory = _this->reserve[--_this->reserveCount];
+            low    = (_this->reserveCount < RESERVE_LOW_WATER);
+        }
+
+        spinUnlock(&_this->reserveLock);
     }
 
-    // Case 1: first element of the list
-    if (*list == item)
+    if (memory != NULL)
     {
-        BlockHeader_t* next = item->next;
-
-        (*list) = next;
+        __atomic_add_fetch(&_this->reserveHits, 1, __ATOMIC_RELAXED);
 
-        if (next != NULL)
+        if (low)
         {
-            next->previous = NULL;
+            Background_wake();
         }
 
-        item->next      = NULL;
-        item->previous  = NULL;
-
-        return 0;
+        *pages = RESERVE_PAGES;
+        return memory;
     }
 
-    // Case 2: element in the middle of the list
-    for (aux = *list; aux != NULL; aux = aux->next)
+    if (!backgroundThread)
     {
-        if (aux->next == item)
+        __atomic_add_fetch(&_this->syncMaps, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_add_fetch(&mapCalls, 1, __ATOMIC_RELAXED);
+
+    return (arenaCount > 1) ? libhalloc_alloc_node(*pages, _this->node) : libhalloc_alloc(*pages);
+}
+
+/**
+ * @brief Arena_unmapPages Give the pages of a released block back to the reserve of the arena while
+ *                         the background worker keeps it, otherwise back to the kernel
+ * @param _this            The arena
+ * @param memory           The pages
+ * @param pages            Number of pages
+ *************************************************************************************************/
+static void Arena_unmapPages(Arena_t* _this, void* memory, size_t pages)
+{
+    if (pages == RESERVE_PAGES)
+    {
+        spinLock(&_this->reserveLock);
+
+        // The worker empties the reserves under their locks once it stopped running
+        if (_this->reserveCount < RESERVE_BLOCKS &&
+            __atomic_load_n(&backgroundState, __ATOMIC_ACQUIRE) == BACKGROUND_RUNNING)
+        {
+            _this->reserve[_this->reserveCount++] = memory;
+            memory = NULL;
+        }
+
+        spinUnlock(&_this->reserveLock);
+    }
+
+    if (memory != NULL)
+    {
+        libhalloc_free(memory, pages);
+    }
+}
+
+/**
+ * @brief InitializeHeap Setup a new heap block for first use
+ * @param arena          Arena the block will belong to
+ * @param size           Size of the block
+ * @param tag            Tag of the allocations the block is dedicated to, 0 if untagged
+ * @return               New heap block
+ *************************************************************************************************/
+static BlockHeader_t* createHeapBlock(Arena_t* arena, size_t size, uintptr_t tag)
+{
+    BlockHeader_t*      block;
+    FreeRegionHeader_t* freeRegion;
+    uint32_t alignRegionSize = PAYLOAD_WITH_OVERHEAD(sizeof(uintptr_t)*2); /* Free block payload (next and prev pointers) */
+
+    block = Block_create(arena, size);
+
+    if (block == NULL)
+    {
+        return NULL;
+    }
+
+    block->tag = tag;
+
+    // Create First Block for alignment, it belongs to the allocator and is not charged to the thread
+    freeRegion = Block_canAllocateSize(block, alignRegionSize);
+
+    if (freeRegion != NULL)
+    {
+        Block_allocateFreeRegion(block, freeRegion, alignRegionSize);
+    }
+
+    return block;
+}
+
+/**
+ * @brief Block_tryLockForSize Lock a block if it can hold an allocation
+ * @param _this                The block
+ * @param size                 Size of the payload user requested
+ * @param tag                  Tag of the allocation, 0 if untagged
+ * @param dense                True(1) for a dense block, false(0) for a block with boundary tags
+ * @return                     True(1) if the block was locked, false(0) otherwise
+ *************************************************************************************************/
+static uint32_t Block_tryLockForSize(BlockHeader_t* _this, size_t size, uintptr_t tag, uint32_t dense)
+{
+    // Tagged allocations only share blocks with allocations of the same tag, and blocks busy
+    // with other threads are skipped rather than waited for
+    if (_this->tag != tag || Block_isDense(_this) != dense || !Block_tryLock(_this))
+    {
+        return 0;
+    }
+
+    if (dense ? DenseBlock_canAllocateSize(_this, size)
+              : (!Block_isFull(_this) && Block_canAllocateSize(_this, PAYLOAD_WITH_OVERHEAD(size))))
+    {
+        return 1;
+    }
+
+    Block_unlock(_this);
+
+    return 0;
+}
+
+/**
+ * @brief getBlockWithFreeRegion Search for a block with a free region with can hold a payload of
+ *                               informed size. In fine-grained mode the block is returned locked,
+ *                               together with its arena, and Block_unlockWithArena releases both.
+ * @param size                   Size of the payload user requested
+ * @param tag                    Tag of the allocation, 0 if untagged
+ * @param dense                  True(1) for a dense block, false(0) for a block with boundary tags
+ * @return                       A block with a free region or NULL
+ *************************************************************************************************/
+static BlockHeader_t* getBlockWithFreeRegion(size_t size, uintptr_t tag, uint32_t dense)
+{
+    BlockHeader_t* block = NULL;
+    Arena_t*       arena = getArena();
+    uint32_t       first;
+    uint32_t       i;
+    size_t         blockSize;
+
+    Arena_lockShared(arena);
+
+    // The blocks freed into last are the most likely to be in the cache and to have room
+    for (i = 0; i < RECENT_BLOCKS; i++)
+    {
+        block = __atomic_load_n(&arena->recent[i], __ATOMIC_RELAXED);
+
+        if (block != NULL && Block_tryLockForSize(block, size, tag, dense))
+        {
+            return block;
+        }
+    }
+
+    // Then the others, by address
+    for(block = arena->blockList;
+        (block != NULL);
+        block = block->next)
+    {
+        if (Block_tryLockForSize(block, size, tag, dense))
+        {
+            return block;
+        }
+    }
+
+    first = (arena->blockList == NULL);
+
+    Arena_unlockShared(arena);
+
+    if (first)
+    {
+        blockSize = (size < PAGE_SIZE*4) ? PAGE_SIZE*4 : size;
+    }
+    else
+    {
+        // Big enough to be shared by the next allocations of its tag
+        blockSize = (tag != 0 && size < TAGGED_BLOCK_SIZE) ? TAGGED_BLOCK_SIZE : size;
+    }
+
+    // Allocate a new block, locked before other threads can see it
+    block = dense ? DenseBlock_create(arena) : createHeapBlock(arena, blockSize, tag);
+
+    if (block == NULL)
+    {
+        return NULL;
+    }
+
+    Block_lock(block);
+    Arena_lockExclusive(arena);
+
+    Arena_addBlock(arena, block);
+
+    if (emptyBlockOverheadSize == 0 && !dense)
+    {
+        emptyBlockOverheadSize = block->usedSize;
+    }
+
+    Arena_downgrade(arena);
+
+    return block;
+}
+
+/**
+ * @brief getBlockWithRegion Using the address informed, search for a heap block which contains it.
+ *                           In fine-grained mode the block is returned locked, together with its
+ *                           arena, and Block_unlockWithArena releases both.
+ * @param region             Region address to be searched
+ * @return                   The heap block which contains it or null
+ *************************************************************************************************/
+static BlockHeader_t* getBlockWithRegion(void* region)
+{
+    BlockHeader_t* block;
+    uint32_t       i;
+
+    // The region may have been allocated by a thread of another node
+    for (i = 0; i < arenaCount; i++)
+    {
+        Arena_lockShared(&arenas[i]);
+
+        for(block = arenas[i].blockList;
+            block != NULL;
+            block = block->next)
+        {
+            uintptr_t regionAddr     = (uintptr_t)region;
+            uintptr_t blockStartAddr = (uintptr_t)block;
+            uintptr_t blockEndAddr   = blockStartAddr + block->size;
+
+            if (regionAddr >= blockStartAddr && regionAddr < blockEndAddr)
+            {
+                Block_lock(block);
+                return block;
+            }
+        }
+
+        Arena_unlockShared(&arenas[i]);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief getFirstBlock Return the first heap block of the first arena which has any
+ * @return              The block or NULL if there are no blocks
+ *************************************************************************************************/
+static BlockHeader_t* getFirstBlock()
+{
+    uint32_t i;
+
+    for (i = 0; i < arenaCount; i++)
+    {
+        if (arenas[i].blockList != NULL)
+        {
+            return arenas[i].blockList;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief getNextBlock Return the heap block following block, continuing in the next arenas
+ * @param block        The current block
+ * @return             The next block or NULL if block is the last one
+ *************************************************************************************************/
+static BlockHeader_t* getNextBlock(BlockHeader_t* block)
+{
+    uint32_t i;
+
+    if (block->next != NULL)
+    {
+        return block->next;
+    }
+
+    for (i = (block->arena - arenas) + 1; i < arenaCount; i++)
+    {
+        if (arenas[i].blockList != NULL)
+        {
+            return arenas[i].blockList;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief BlockList_addBlockToList Add a block heap to the block heap linked list
+ * @param list                     The block heap linked list
+ * @param item                     The item to be added
+ * @return
+ *************************************************************************************************/
+static uint32_t BlockList_addBlockToList(BlockHeader_t** list, BlockHeader_t* item)
+{
+    BlockHeader_t* aux = *list;
+
+    if (item == NULL)
+    {
+        return 0;
+    }
+
+    if (*list == NULL)
+    {
+        item->next     = NULL;
+        item->previous = NULL;
+        *list = item;
+        return 0;
+    }
+
+    if (*list > item)
+    {
+        item->next     = *list;
+        item->previous = NULL;
+        (*list)->previous = item;
+        *list = item;
+        return 0;
+    }
+
+    // Get the last item in list
+    // Order by region address
+    while ((aux->next != NULL) && (item < aux->next))
+    {
+        aux = aux->next;
+    }
+
+    item->next     = aux->next;
+    item->previous = aux;
+    aux->next      = item;
+
+    return 0;
+}
+
+/**
+ * @brief BlockList_removeBlockFromList Remove a block heap to the block heap linked list
+ * @param list                          The block heap linked list
+ * @param item                          The item to be removed
+ * @return
+ *************************************************************************************************/
+static uint32_t BlockList_removeBlockFromList(BlockHeader_t** list, BlockHeader_t* item)
+{
+    BlockHeader_t* aux;
+
+    if (item == NULL)
+    {
+        return -1;
+    }
+
+    // Case 1: first element of the list
+    if (*list == item)
+    {
+        BlockHeader_t* next = item->next;
+
+        (*list) = next;
+
+        if (next != NULL)
+        {
+            next->previous = NULL;
+        }
+
+        item->next      = NULL;
+        item->previous  = NULL;
+
+        return 0;
+    }
+
+    // Case 2: element in the middle of the list
+    for (aux = *list; aux != NULL; aux = aux->next)
+    {
+        if (aux->next == item)
         {
             BlockHeader_t* next = item->next;
 
@@ -383,24 +1121,27 @@ static FreeRegionHeader_t* FreeRegion_split(FreeRegionHeader_t* original, size_t
 
     uintptr_t           newFreeAddr = originalAddr + alignedSize;
     FreeRegionHeader_t* newFree     = (FreeRegionHeader_t*) newFreeAddr;
-    uint32_t            newFreeSize = original->metadata.size - alignedSize;
-
-    FreeRegion_create(original, alignedSize);
+    uint32_t            newFreeSize;
 
-    /* If the "newFree" region calculated address corresponds to an allocated block
-     * DO NOTHING OR BAD THINGS WILL HAPPEN! (user data corruption is the least bad of them) */
-    if (newFree->metadata.used == 1)
+    /* If the "newFree" region calculated address is past the original region it would
+     * overlap the next region. DO NOTHING OR BAD THINGS WILL HAPPEN! */
+    if (alignedSize >= original->metadata.size)
     {
         return NULL;
     }
 
-    /* If the new free region is to small to hold the own metadata, skip it */
+    newFreeSize = original->metadata.size - alignedSize;
+
+    /* If the new free region is to small to hold the own metadata, keep it in the original
+     * region: every byte of the block must belong to a region, so the heap can be walked
+     * through the boundary tags */
     if (newFreeSize < (sizeof(FreeRegionHeader_t) + sizeof(AllocMetadata_t)))
     {
         return NULL;
     }
 
     /* Ok, we have a SAFE non-allocated region to work */
+    FreeRegion_create(original, alignedSize);
     FreeRegion_create(newFree, newFreeSize);
 
     return newFree;
@@ -571,6 +1312,9 @@ static uint32_t Block_addRegionToFreeList(BlockHeader_t* _this, FreeRegionHeader
     list = &_this->freeRegions[i];
     aux  = *list;
 
+    counterAdd(&_this->arena->freeCount[i], 1);
+    counterAdd(&_this->arena->freeSize[i],  item->metadata.size);
+
     if (*list == NULL)
     {
         item->next     = NULL;
@@ -619,6 +1363,9 @@ static uint32_t Block_removeRegionFromFreeList(BlockHeader_t* _this, FreeRegionH
         return -1;
     }
 
+    counterAdd(&_this->arena->freeCount[i], -(size_t)1);
+    counterAdd(&_this->arena->freeSize[i],  -(size_t)item->metadata.size);
+
     // Case 1: first element of the list
     if (*list == item)
     {
@@ -676,6 +1423,7 @@ static AllocMetadata_t* Block_useRegion(BlockHeader_t* _this, FreeRegionHeader_t
     freeRegionFooter->used    = 1;
 
     _this->usedSize += freeRegion->metadata.size;
+    counterAdd(&_this->arena->usedSize, freeRegion->metadata.size);
 
     return (AllocMetadata_t*) freeRegionAddr;
 }
@@ -699,23 +1447,28 @@ static FreeRegionHeader_t* Block_freeRegion(BlockHeader_t* _this, AllocMetadata_
     regionFooter->size  = freeRegion->metadata.size;
 
     _this->usedSize -= freeRegion->metadata.size;
+    counterAdd(&_this->arena->usedSize, -(size_t)freeRegion->metadata.size);
+
+    threadStats.deallocated += REGION_PAYLOAD_SIZE(freeRegion->metadata.size);
 
     return freeRegion;
 }
 
 /**
  * @brief Block_create Allocate from kernel a some pages to use
+ * @param arena        Arena the block will belong to, its pages are placed on the arena node
  * @param size         Block size in bytes requested by user
  * @return             A block of memory which can hold at least data @param size bytes
  *************************************************************************************************/
-static BlockHeader_t* Block_create(size_t size)
+static BlockHeader_t* Block_create(Arena_t* arena, size_t size)
 {
     BlockHeader_t*  blockHeader  = NULL;
     void*           memoryPtr    = NULL;
     size_t          memorySize   = size + sizeof(BlockHeader_t) + sizeof(FreeRegionHeader_t) + sizeof(AllocMetadata_t);
     size_t          pageQuantity = (memorySize / PAGE_SIZE) + (memorySize % PAGE_SIZE > 0);
+    uint32_t        index;
 
-    memoryPtr = libhalloc_alloc(pageQuantity);
+    memoryPtr = Arena_mapPages(arena, &pageQuantity);
 
     if (memoryPtr == NULL)
     {
@@ -724,15 +1477,22 @@ static BlockHeader_t* Block_create(size_t size)
 
     blockHeader = (BlockHeader_t*) memoryPtr;
 
+    // The pages may come from the reserve, left over by a released block of either layout
+    memset(blockHeader, 0, sizeof(BlockHeader_t));
+
     blockHeader->pages      = pageQuantity;
     blockHeader->size       = pageQuantity * PAGE_SIZE;
-    blockHeader->next       = NULL; //blockHeader;  // Point to itself
-    blockHeader->previous   = NULL; //blockHeader;  // Point to itself
     blockHeader->usedSize   = sizeof(BlockHeader_t);
-    memset(blockHeader->freeRegions, 0, sizeof(FreeRegionHeader_t*) * FREE_BLOCKS_SETS);
+    blockHeader->arena      = arena;
+
+    // Create the only free region covering the rest of the block, fitted classes may go past a page
+    index = toFreeListIndex(blockHeader->size - sizeof(BlockHeader_t));
 
-    // Create the only free region covering the rest of the block
-    blockHeader->freeRegions[LARGE_FREE_BLOCK_INDEX] = FreeRegion_create(memoryPtr + sizeof(BlockHeader_t), blockHeader->size - sizeof(BlockHeader_t));
+    blockHeader->freeRegions[index] = FreeRegion_create(memoryPtr + sizeof(BlockHeader_t), blockHeader->size - sizeof(BlockHeader_t));
+
+    counterAdd(&arena->usedSize, sizeof(BlockHeader_t));
+    counterAdd(&arena->freeCount[index], 1);
+    counterAdd(&arena->freeSize[index],  blockHeader->size - sizeof(BlockHeader_t));
 
     return blockHeader;
 }
@@ -763,7 +1523,8 @@ static FreeRegionHeader_t* Block_canAllocateSize(BlockHeader_t* _this, uint32_t
         return NULL;
     }
 
-    for (i = 0; i<FREE_BLOCKS_SETS; i++)
+    // The lists of the smaller classes have no region big enough
+    for (i = toFreeListIndex(size); i<FREE_BLOCKS_SETS; i++)
     {
         for (it = _this->freeRegions[i]; it != NULL; it = it->next)
         {
@@ -791,26 +1552,56 @@ static uint32_t Block_haveUserAllocations(BlockHeader_t* _this)
         return 0;
     }
 
-    return _this->usedSize > emptyBlockOverheadSize;
+    return _this->usedSize > (Block_isDense(_this) ? DENSE_DATA_OFFSET : emptyBlockOverheadSize);
 }
 
 /**
- * @brief Block_allocateRegion Allocate a region for use
- * @param _this                Heap block to be used in allocation
- * @param size                 Size requested by user
- * @return                     Pointer to header of allocated region
+ * @brief Block_getNearestFreeRegion Search the heap block for the free region closest to an address
+ *                                   which can allocate the specified size
+ * @param _this                      Heap block to be searched
+ * @param size                       The region size
+ * @param hint                       The address
+ * @return                           The free region if found or null otherwise
  *************************************************************************************************/
-static AllocMetadata_t* Block_allocateRegion(BlockHeader_t* _this, size_t size)
+static FreeRegionHeader_t* Block_getNearestFreeRegion(BlockHeader_t* _this, uint32_t size, void* hint)
 {
-    uint32_t            regionSize    = PAYLOAD_WITH_OVERHEAD(size);
-    FreeRegionHeader_t* newFreeRegion = NULL;
-    FreeRegionHeader_t* freeRegion    = Block_canAllocateSize(_this, regionSize);
+    FreeRegionHeader_t* nearest  = NULL;
+    uintptr_t           distance = UINTPTR_MAX;
+    uint32_t            i;
 
-    if (freeRegion == NULL)
+    for (i = 0; i<FREE_BLOCKS_SETS; i++)
     {
-        return NULL;
+        FreeRegionHeader_t* it;
+
+        for (it = _this->freeRegions[i]; it != NULL; it = it->next)
+        {
+            uintptr_t itDistance = ((uintptr_t)it > (uintptr_t)hint) ? (uintptr_t)it - (uintptr_t)hint
+                                                                     : (uintptr_t)hint - (uintptr_t)it;
+
+            // An exact fit is fine here, the hole next to the hint is the one wanted
+            if (itDistance < distance && FreeRegion_getSizeForAlignment(it, size) <= it->metadata.size)
+            {
+                nearest  = it;
+                distance = itDistance;
+            }
+        }
     }
 
+    return nearest;
+}
+
+/**
+ * @brief Block_allocateFreeRegion Allocate the beginning of a free region, giving the rest back to the
+ *                                 free lists
+ * @param _this                    Heap block which the free region belongs
+ * @param freeRegion               Free region which can allocate regionSize
+ * @param regionSize               Size of the region to allocate, overhead included
+ * @return                         Pointer to header of allocated region
+ *************************************************************************************************/
+static AllocMetadata_t* Block_allocateFreeRegion(BlockHeader_t* _this, FreeRegionHeader_t* freeRegion, uint32_t regionSize)
+{
+    FreeRegionHeader_t* newFreeRegion = NULL;
+
     Block_removeRegionFromFreeList(_this, freeRegion);        // It will be allocated
     newFreeRegion = FreeRegion_split(freeRegion, regionSize); // Split
     Block_addRegionToFreeList( _this, newFreeRegion);         // New region to free list
@@ -818,6 +1609,55 @@ static AllocMetadata_t* Block_allocateRegion(BlockHeader_t* _this, size_t size)
     return Block_useRegion(_this, freeRegion); // Aloc
 }
 
+/**
+ * @brief Block_allocateRegion Allocate a region for use
+ * @param _this                Heap block to be used in allocation
+ * @param size                 Size requested by user
+ * @return                     Pointer to header of allocated region
+ *************************************************************************************************/
+static AllocMetadata_t* Block_allocateRegion(BlockHeader_t* _this, size_t size)
+{
+    uint32_t            regionSize    = PAYLOAD_WITH_OVERHEAD(size);
+    FreeRegionHeader_t* freeRegion    = Block_canAllocateSize(_this, regionSize);
+    AllocMetadata_t*    memoryPtr;
+
+    if (freeRegion == NULL)
+    {
+        return NULL;
+    }
+
+    memoryPtr = Block_allocateFreeRegion(_this, freeRegion, regionSize);
+
+    threadStats.allocated += REGION_PAYLOAD_SIZE(memoryPtr->size);
+
+    return memoryPtr;
+}
+
+/**
+ * @brief Block_allocateRegionNear Allocate the free region closest to an address for use
+ * @param _this                    Heap block to be used in allocation
+ * @param size                     Size requested by user
+ * @param hint                     The address
+ * @return                         Pointer to header of allocated region
+ *************************************************************************************************/
+static AllocMetadata_t* Block_allocateRegionNear(BlockHeader_t* _this, size_t size, void* hint)
+{
+    uint32_t            regionSize = PAYLOAD_WITH_OVERHEAD(size);
+    FreeRegionHeader_t* freeRegion = Block_getNearestFreeRegion(_this, regionSize, hint);
+    AllocMetadata_t*    memoryPtr;
+
+    if (freeRegion == NULL)
+    {
+        return NULL;
+    }
+
+    memoryPtr = Block_allocateFreeRegion(_this, freeRegion, regionSize);
+
+    threadStats.allocated += REGION_PAYLOAD_SIZE(memoryPtr->size);
+
+    return memoryPtr;
+}
+
 /**
  * @brief Block_deallocateRegion Deallocate a region in block
  * @param _this                  Heap block to be used
@@ -835,131 +1675,2421 @@ static void Block_deallocateRegion(BlockHeader_t* _this, AllocMetadata_t* region
 }
 
 /*************************************************************************************************/
-/*********************************** Public interface functions **********************************/
+/*********************************** Call site accounting ****************************************/
 
 /**
- * @brief malloc
- * @param size
- * @return
+ * @brief CallSite_lookup Find the call site entry of a key, claiming a new one if needed
+ * @param key             Call site tag or return address
+ * @param name            Call site tag or NULL
+ * @return                Index of the call site in the table
  *************************************************************************************************/
-void* malloc(size_t size)
+static uint32_t CallSite_lookup(const void* key, const char* name)
 {
-    BlockHeader_t*   block     = NULL;
-    AllocMetadata_t* memoryPtr = NULL;
+    uint32_t hash = (uint32_t)(((uintptr_t)key >> 3) * 2654435761u);
+    uint32_t i;
+
+    for (i = 0; i < CALL_SITES; i++)
+    {
+        uint32_t    index   = (hash + i) & (CALL_SITES - 1);
+        const void* current = __atomic_load_n(&callSites[index].key, __ATOMIC_ACQUIRE);
+
+        // The last entry is kept for the overflow
+        if (index == CALL_SITES - 1)
+        {
+            continue;
+        }
+
+        // The name is stored before the key is published, readers of the key see it
+        if (current == NULL)
+        {
+            if (__atomic_compare_exchange_n(&callSites[index].key, &current, CALL_SITE_CLAIMED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                callSites[index].name = name;
+                __atomic_store_n(&callSites[index].key, key, __ATOMIC_RELEASE);
+                return index;
+            }
+        }
+
+        // Claimed by another thread, maybe for this very key
+        while (current == CALL_SITE_CLAIMED)
+        {
+            current = __atomic_load_n(&callSites[index].key, __ATOMIC_ACQUIRE);
+        }
+
+        if (current == key)
+        {
+            return index;
+        }
+    }
+
+    callSites[CALL_SITES - 1].name = "(other)";
+    __atomic_store_n(&callSites[CALL_SITES - 1].key, "(other)", __ATOMIC_RELEASE);
+
+    return CALL_SITES - 1;
+}
+
+/**
+ * @brief CallSite_allocated Account an allocation to its call site
+ * @param index              Index of the call site in the table
+ * @param size               Size requested by user
+ *************************************************************************************************/
+static void CallSite_allocated(uint32_t index, uint32_t size)
+{
+    CallSite_t* _this = &callSites[index];
+    uint64_t    live  = __atomic_add_fetch(&_this->liveBytes, size, __ATOMIC_RELAXED);
+    uint64_t    peak  = __atomic_load_n(&_this->peakBytes, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&_this->count, 1, __ATOMIC_RELAXED);
+
+    while (live > peak)
+    {
+        if (__atomic_compare_exchange_n(&_this->peakBytes, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief CallSite_freed Account the release of a region allocated by halloc_malloc_site
+ * @param region         Header of the allocated region
+ *************************************************************************************************/
+static void CallSite_freed(AllocMetadata_t* region)
+{
+    uintptr_t          trailerAddr = (uintptr_t)region + region->size - sizeof(AllocMetadata_t) - sizeof(CallSiteTrailer_t);
+    CallSiteTrailer_t* trailer     = (CallSiteTrailer_t*) trailerAddr;
+
+    __atomic_sub_fetch(&callSites[trailer->site].liveBytes, trailer->size, __ATOMIC_RELAXED);
+}
+
+/*************************************************************************************************/
+/*********************************** Lock profiling **********************************************/
+
+/**
+ * @brief LockProfile_acquired Account an acquisition of a lock of the class
+ * @param _this                Profile of the lock class
+ * @param waitStart            When the thread started waiting for the lock, 0 if it did not wait
+ * @return                     When the lock was acquired if its hold time is sampled, 0 otherwise
+ *************************************************************************************************/
+static uint64_t LockProfile_acquired(LockProfile_t* _this, uint64_t waitStart)
+{
+    uint64_t count = __atomic_add_fetch(&_this->acquisitions, 1, __ATOMIC_RELAXED);
+    uint64_t now;
+    uint64_t wait;
+    uint64_t max;
+
+    // The uncontended path reads no clock, except for the samples
+    if (waitStart == 0)
+    {
+        return (count & (LOCK_HOLD_SAMPLING - 1)) == 0 ? libhalloc_clock() : 0;
+    }
+
+    now  = libhalloc_clock();
+    wait = now - waitStart;
+    max  = __atomic_load_n(&_this->waitMax, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&_this->contended, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_this->waitTotal, wait, __ATOMIC_RELAXED);
+
+    while (wait > max)
+    {
+        if (__atomic_compare_exchange_n(&_this->waitMax, &max, wait, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    return now;
+}
+
+/**
+ * @brief LockProfile_released Account the hold time of a lock of the class, if it was sampled
+ * @param _this                Profile of the lock class
+ * @param holdStart            What LockProfile_acquired returned for the acquisition
+ *************************************************************************************************/
+static void LockProfile_released(LockProfile_t* _this, uint64_t holdStart)
+{
+    uint64_t hold;
+    uint32_t i = 0;
+
+    if (holdStart == 0)
+    {
+        return;
+    }
+
+    hold = libhalloc_clock() - holdStart;
+
+    while (hold > 1 && i < HALLOC_LOCK_HISTOGRAM - 1)
+    {
+        hold >>= 1;
+        i++;
+    }
+
+    __atomic_add_fetch(&_this->holdHistogram[i], 1, __ATOMIC_RELAXED);
+}
+
+#ifndef HALLOC_FINE_GRAINED_LOCKS
+
+/**
+ * @brief lockHeap Acquire the heap lock, accounting how long the thread waited for it
+ * @return         0 if the lock was acquired
+ *************************************************************************************************/
+static int lockHeap()
+{
+    uint64_t waitStart = 0;
+
+    if (libhalloc_trylock() != 0)
+    {
+        waitStart = libhalloc_clock();
+
+        if (libhalloc_lock() != 0)
+        {
+            return -1;
+        }
+    }
+
+    // Reentering the lock is not another acquisition
+    if (heapLockDepth++ == 0)
+    {
+        heapLockHoldStart = LockProfile_acquired(&lockProfiles[HALLOC_LOCK_HEAP], waitStart);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief unlockHeap Release the heap lock, accounting how long it was held
+ *************************************************************************************************/
+static void unlockHeap()
+{
+    if (--heapLockDepth == 0)
+    {
+        LockProfile_released(&lockProfiles[HALLOC_LOCK_HEAP], heapLockHoldStart);
+    }
+
+    libhalloc_unlock();
+}
+
+/**
+ * @brief lockBlocks Lock the heap for allocating from or freeing to its blocks
+ * @return           0 if the heap was locked
+ *************************************************************************************************/
+static int lockBlocks()
+{
+    return lockHeap();
+}
+
+/**
+ * @brief unlockBlocks Release the lock taken by lockBlocks
+ *************************************************************************************************/
+static void unlockBlocks()
+{
+    unlockHeap();
+}
+
+static void     Arena_lockShared     (Arena_t* _this)       { }
+static void     Arena_unlockShared   (Arena_t* _this)       { }
+static void     Arena_lockExclusive  (Arena_t* _this)       { }
+static void     Arena_unlockExclusive(Arena_t* _this)       { }
+static void     Arena_downgrade      (Arena_t* _this)       { }
+static uint32_t Block_tryLock        (BlockHeader_t* _this) { return 1; }
+static void     Block_lock           (BlockHeader_t* _this) { }
+static void     Block_unlock         (BlockHeader_t* _this) { }
+static void     Block_unlockWithArena(BlockHeader_t* _this) { }
+
+#else
+
+/*************************************************************************************************/
+/*********************************** Fine-grained locking ****************************************/
+
+/**
+ * @brief Arena_lockShared Take the arena lock to use its blocks, which keeps them from being added
+ *                         or released. Nothing is taken while the thread holds the heap lock.
+ * @param _this            The arena
+ *************************************************************************************************/
+static void Arena_lockShared(Arena_t* _this)
+{
+    uint64_t waitStart = 0;
+
+    if (heapLockDepth > 0)
+    {
+        return;
+    }
+
+    for (;;)
+    {
+        uint32_t state = __atomic_load_n(&_this->lock, __ATOMIC_RELAXED);
+
+        if ((state & (ARENA_LOCK_WRITER | ARENA_LOCK_PENDING)) == 0 &&
+            __atomic_compare_exchange_n(&_this->lock, &state, state + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+
+        if (waitStart == 0)
+        {
+            waitStart = libhalloc_clock();
+        }
+    }
+
+    // Readers overlap, so only their waits are profiled
+    LockProfile_acquired(&lockProfiles[HALLOC_LOCK_ARENA], waitStart);
+}
+
+/**
+ * @brief Arena_unlockShared Release the arena lock taken by Arena_lockShared
+ * @param _this              The arena
+ *************************************************************************************************/
+static void Arena_unlockShared(Arena_t* _this)
+{
+    if (heapLockDepth > 0)
+    {
+        return;
+    }
+
+    __atomic_sub_fetch(&_this->lock, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Arena_lockExclusive Take the arena lock to add or release blocks, waiting for the threads
+ *                            using its blocks. Nothing is taken while the thread holds the heap lock.
+ * @param _this               The arena
+ *************************************************************************************************/
+static void Arena_lockExclusive(Arena_t* _this)
+{
+    uint64_t waitStart = 0;
+
+    if (heapLockDepth > 0)
+    {
+        return;
+    }
+
+    for (;;)
+    {
+        uint32_t state = __atomic_load_n(&_this->lock, __ATOMIC_RELAXED);
+
+        if ((state & ~ARENA_LOCK_PENDING) == 0)
+        {
+            if (__atomic_compare_exchange_n(&_this->lock, &state, ARENA_LOCK_WRITER, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        // Hold new readers back, so a busy arena can not starve the thread
+        if ((state & ARENA_LOCK_PENDING) == 0)
+        {
+            __atomic_fetch_or(&_this->lock, ARENA_LOCK_PENDING, __ATOMIC_RELAXED);
+        }
+
+        if (waitStart == 0)
+        {
+            waitStart = libhalloc_clock();
+        }
+    }
+
+    _this->holdStart = LockProfile_acquired(&lockProfiles[HALLOC_LOCK_ARENA], waitStart);
+}
+
+/**
+ * @brief Arena_unlockExclusive Release the arena lock taken by Arena_lockExclusive
+ * @param _this                 The arena
+ *************************************************************************************************/
+static void Arena_unlockExclusive(Arena_t* _this)
+{
+    if (heapLockDepth > 0)
+    {
+        return;
+    }
+
+    LockProfile_released(&lockProfiles[HALLOC_LOCK_ARENA], _this->holdStart);
+
+    // Keeps the pending flag of other waiting threads
+    __atomic_fetch_and(&_this->lock, ~ARENA_LOCK_WRITER, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Arena_downgrade Turn the arena lock taken by Arena_lockExclusive into a shared one, with no
+ *                        other thread getting it exclusively in between
+ * @param _this           The arena
+ *************************************************************************************************/
+static void Arena_downgrade(Arena_t* _this)
+{
+    if (heapLockDepth > 0)
+    {
+        return;
+    }
+
+    LockProfile_released(&lockProfiles[HALLOC_LOCK_ARENA], _this->holdStart);
+
+    __atomic_fetch_add(&_this->lock, 1 - ARENA_LOCK_WRITER, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Block_tryLock Take the block lock if no other thread holds it
+ * @param _this         The block
+ * @return              True(1) if the lock was taken or false(0) otherwise
+ *************************************************************************************************/
+static uint32_t Block_tryLock(BlockHeader_t* _this)
+{
+    if (heapLockDepth > 0)
+    {
+        return 1;
+    }
+
+    if (__atomic_load_n(&_this->lock, __ATOMIC_RELAXED) != 0 ||
+        __atomic_exchange_n(&_this->lock, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        return 0;
+    }
+
+    blockHoldStart = LockProfile_acquired(&lockProfiles[HALLOC_LOCK_BLOCK], 0);
+
+    return 1;
+}
+
+/**
+ * @brief Block_lock Take the block lock, waiting for the thread holding it
+ * @param _this      The block
+ *************************************************************************************************/
+static void Block_lock(BlockHeader_t* _this)
+{
+    uint64_t waitStart;
+
+    if (heapLockDepth > 0 || Block_tryLock(_this))
+    {
+        return;
+    }
+
+    waitStart = libhalloc_clock();
+
+    while (__atomic_exchange_n(&_this->lock, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        while (__atomic_load_n(&_this->lock, __ATOMIC_RELAXED) != 0)
+        {
+            // Spin on a read, the holder only touches the regions of one block
+        }
+    }
+
+    blockHoldStart = LockProfile_acquired(&lockProfiles[HALLOC_LOCK_BLOCK], waitStart);
+}
+
+/**
+ * @brief Block_unlock Release the block lock
+ * @param _this        The block
+ *************************************************************************************************/
+static void Block_unlock(BlockHeader_t* _this)
+{
+    if (heapLockDepth > 0)
+    {
+        return;
+    }
+
+    LockProfile_released(&lockProfiles[HALLOC_LOCK_BLOCK], blockHoldStart);
+
+    __atomic_store_n(&_this->lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Block_unlockWithArena Release a block returned locked by getBlockWithFreeRegion or by
+ *                              getBlockWithRegion, together with its arena
+ * @param _this                 The block, may be NULL
+ *************************************************************************************************/
+static void Block_unlockWithArena(BlockHeader_t* _this)
+{
+    if (_this == NULL)
+    {
+        return;
+    }
+
+    Block_unlock(_this);
+    Arena_unlockShared(_this->arena);
+}
+
+/**
+ * @brief lockHeap Take every arena exclusively, which stops every other thread from using the heap
+ * @return         0 if the heap was locked
+ *************************************************************************************************/
+static int lockHeap()
+{
+    uint32_t i;
+
+    if (heapLockDepth > 0)
+    {
+        heapLockDepth++;
+        return 0;
+    }
+
+    for (i = 0; i < MAX_ARENAS; i++)
+    {
+        Arena_lockExclusive(&arenas[i]);
+    }
+
+    heapLockDepth = 1;
+
+    return 0;
+}
+
+/**
+ * @brief unlockHeap Release the arenas taken by lockHeap
+ *************************************************************************************************/
+static void unlockHeap()
+{
+    uint32_t i;
+
+    if (--heapLockDepth > 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < MAX_ARENAS; i++)
+    {
+        Arena_unlockExclusive(&arenas[i]);
+    }
+}
+
+/**
+ * @brief lockBlocks Lock the heap for allocating from or freeing to its blocks. Nothing is taken,
+ *                   the blocks are locked one by one.
+ * @return           0
+ *************************************************************************************************/
+static int lockBlocks()
+{
+    return 0;
+}
+
+/**
+ * @brief unlockBlocks Release the lock taken by lockBlocks
+ *************************************************************************************************/
+static void unlockBlocks()
+{
+}
+
+#endif
+
+#ifndef HALLOC_OUT_OF_BAND_METADATA
+
+/**
+ * @brief getPayloadSize Return the size of the payload of an allocation, padding included
+ * @param pointer        Payload address returned to the user
+ * @return               Size of the payload in bytes
+ *************************************************************************************************/
+static size_t getPayloadSize(void* pointer)
+{
+    AllocMetadata_t* header = (AllocMetadata_t*)(pointer - sizeof(AllocMetadata_t));
+
+    return REGION_PAYLOAD_SIZE(header->size);
+}
+
+static uint32_t       isDenseSize                (size_t size)                                       { return 0; }
+static uint32_t       Block_isDense              (BlockHeader_t* _this)                              { return 0; }
+static BlockHeader_t* DenseBlock_create          (Arena_t* arena)                                    { return NULL; }
+static uint32_t       DenseBlock_canAllocateSize (BlockHeader_t* _this, size_t size)                 { return 0; }
+static void*          DenseBlock_allocateRegion  (BlockHeader_t* _this, size_t size, void* hint)     { return NULL; }
+static void           DenseBlock_deallocateRegion(BlockHeader_t* _this, void* pointer)               { }
+static int            DenseBlock_iterate         (BlockHeader_t* _this, halloc_iterate_callback_t callback, void* ctx) { return 0; }
+
+#else
+
+/*************************************************************************************************/
+/*********************************** Out-of-band metadata ****************************************/
+
+/**
+ * @brief Bitmap_find Search a bitmap for the first bit with a value
+ * @param bitmap      The bitmap
+ * @param from        First bit to be checked
+ * @param limit       Bit after the last one to be checked
+ * @param value       Value searched, 0 or 1
+ * @return            Index of the bit found, or limit if there is none
+ *************************************************************************************************/
+static uint32_t Bitmap_find(uint64_t* bitmap, uint32_t from, uint32_t limit, uint32_t value)
+{
+    while (from < limit)
+    {
+        uint64_t word = value ? bitmap[from / 64] : ~bitmap[from / 64];
+
+        word &= ~0ull << (from % 64);
+
+        if (word != 0)
+        {
+            uint32_t found = (from & ~63u) + __builtin_ctzll(word);
+
+            return (found < limit) ? found : limit;
+        }
+
+        from = (from & ~63u) + 64;
+    }
+
+    return limit;
+}
+
+/**
+ * @brief Bitmap_findClearRun Search a bitmap for the first run of clear bits, a word at a time
+ * @param bitmap              The bitmap
+ * @param words               Words in the bitmap
+ * @param from                First bit the run may start at
+ * @param count               Bits in the run, 1 to 64
+ * @return                    Index of the first bit of the run, or words*64 if there is none
+ *************************************************************************************************/
+static uint32_t Bitmap_findClearRun(uint64_t* bitmap, uint32_t words, uint32_t from, uint32_t count)
+{
+    uint32_t word;
+
+    for (word = from / 64; word < words; word++)
+    {
+        unsigned __int128 runs   = ~bitmap[word];
+        uint32_t          length = 1;
+        uint64_t          found;
+
+        // Runs starting in this word may end in the next one
+        if (word + 1 < words)
+        {
+            runs |= (unsigned __int128)~bitmap[word + 1] << 64;
+        }
+
+        // Bit i stays set if bits i to i + length - 1 are all clear
+        while (length * 2 <= count)
+        {
+            runs   &= runs >> length;
+            length *= 2;
+        }
+
+        runs &= runs >> (count - length);
+        found = (uint64_t)runs;
+
+        if (word == from / 64)
+        {
+            found &= ~0ull << (from % 64);
+        }
+
+        if (found != 0)
+        {
+            return word * 64 + __builtin_ctzll(found);
+        }
+    }
+
+    return words * 64;
+}
+
+/**
+ * @brief Bitmap_fill Set or clear a range of bits of a bitmap
+ * @param bitmap      The bitmap
+ * @param from        First bit of the range
+ * @param count       Bits in the range
+ * @param value       Value written, 0 or 1
+ *************************************************************************************************/
+static void Bitmap_fill(uint64_t* bitmap, uint32_t from, uint32_t count, uint32_t value)
+{
+    while (count > 0)
+    {
+        uint32_t bits = 64 - (from % 64);
+        uint64_t mask;
+
+        if (bits > count)
+        {
+            bits = count;
+        }
+
+        mask = ((bits == 64) ? ~0ull : ((1ull << bits) - 1)) << (from % 64);
+
+        if (value)
+        {
+            bitmap[from / 64] |= mask;
+        }
+        else
+        {
+            bitmap[from / 64] &= ~mask;
+        }
+
+        from  += bits;
+        count -= bits;
+    }
+}
+
+/**
+ * @brief isDenseSize Informs if a payload is placed in a dense block
+ * @param size        Size requested by user
+ * @return            True(1) or false(0)
+ *************************************************************************************************/
+static uint32_t isDenseSize(size_t size)
+{
+    return size <= DENSE_MAX_SIZE;
+}
+
+/**
+ * @brief getPayloadSize Return the size of the payload of an allocation, padding included. The
+ *                       heap lock must not be held, the block of the allocation is looked up.
+ * @param pointer        Payload address returned to the user
+ * @return               Size of the payload in bytes
+ *************************************************************************************************/
+static size_t getPayloadSize(void* pointer)
+{
+    AllocMetadata_t* header = (AllocMetadata_t*)(pointer - sizeof(AllocMetadata_t));
+    BlockHeader_t*   block;
+    size_t           size   = 0;
+
+    if (lockBlocks() != 0)
+    {
+        return 0;
+    }
+
+    block = getBlockWithRegion(pointer);
+
+    if (block != NULL)
+    {
+        size = Block_isDense(block) ? DenseBlock_getPayloadSize(block, pointer) : REGION_PAYLOAD_SIZE(header->size);
+    }
+
+    Block_unlockWithArena(block);
+    unlockBlocks();
+
+    return size;
+}
+
+/**
+ * @brief Block_isDense Informs if the regions of a heap block are tracked by a side table
+ * @param _this         The heap block
+ * @return              True(1) or false(0)
+ *************************************************************************************************/
+static uint32_t Block_isDense(BlockHeader_t* _this)
+{
+    return (_this != NULL) && _this->dense;
+}
+
+/**
+ * @brief DenseBlock_getTable Return the side table of a dense block
+ * @param _this               The dense block
+ * @return                    The table, right after the block header
+ *************************************************************************************************/
+static DenseTable_t* DenseBlock_getTable(BlockHeader_t* _this)
+{
+    return (DenseTable_t*)((uintptr_t)_this + sizeof(BlockHeader_t));
+}
+
+/**
+ * @brief DenseBlock_toGranule Return the index of the granule holding an address of a dense block
+ * @param _this                The dense block
+ * @param address              Address inside the payloads of the block
+ * @return                     Index of the granule
+ *************************************************************************************************/
+static uint32_t DenseBlock_toGranule(BlockHeader_t* _this, void* address)
+{
+    return ((uintptr_t)address - (uintptr_t)_this - DENSE_DATA_OFFSET) / DENSE_GRANULE;
+}
+
+/**
+ * @brief DenseBlock_create Allocate from kernel a dense block, with all its granules free
+ * @param arena             Arena the block will belong to, its pages are placed on the arena node
+ * @return                  The dense block or NULL
+ *************************************************************************************************/
+static BlockHeader_t* DenseBlock_create(Arena_t* arena)
+{
+    size_t         pages = DENSE_BLOCK_SIZE / PAGE_SIZE;
+    BlockHeader_t* blockHeader;
+    DenseTable_t*  table;
+
+    blockHeader = Arena_mapPages(arena, &pages);
+
+    if (blockHeader == NULL)
+    {
+        return NULL;
+    }
+
+    memset(blockHeader, 0, DENSE_DATA_OFFSET);
+
+    blockHeader->pages    = pages;
+    blockHeader->size     = DENSE_BLOCK_SIZE;
+    blockHeader->usedSize = DENSE_DATA_OFFSET;
+    blockHeader->arena    = arena;
+    blockHeader->dense    = 1;
+
+    counterAdd(&arena->usedSize,  DENSE_DATA_OFFSET);
+    counterAdd(&arena->denseFree, DENSE_GRANULES * DENSE_GRANULE);
+
+    // The bits past the last granule are never free
+    table = DenseBlock_getTable(blockHeader);
+    Bitmap_fill(table->used, DENSE_GRANULES, DENSE_WORDS * 64 - DENSE_GRANULES, 1);
+
+    return blockHeader;
+}
+
+/**
+ * @brief DenseBlock_findFreeRegion Search a dense block for a run of free granules
+ * @param _this                     The dense block
+ * @param from                      Granule the search starts from
+ * @param count                     Granules wanted
+ * @return                          First granule of the run, or DENSE_GRANULES if there is none
+ *************************************************************************************************/
+static uint32_t DenseBlock_findFreeRegion(BlockHeader_t* _this, uint32_t from, uint32_t count)
+{
+    DenseTable_t* table = DenseBlock_getTable(_this);
+    uint32_t      whole = (from <= table->firstFree);
+    uint32_t      start;
+
+    if (table->missingRun != 0 && count >= table->missingRun)
+    {
+        return DENSE_GRANULES;
+    }
+
+    if (from < table->firstFree)
+    {
+        from = table->firstFree;
+    }
+
+    // The granules past the end are used, no run can cross it
+    start = Bitmap_findClearRun(table->used, DENSE_WORDS, from, count);
+
+    if (start < DENSE_GRANULES)
+    {
+        return start;
+    }
+
+    // Allocations only shorten the runs, the next searches for as many granules can be skipped
+    if (whole && (table->missingRun == 0 || count < table->missingRun))
+    {
+        table->missingRun = count;
+    }
+
+    return DENSE_GRANULES;
+}
+
+/**
+ * @brief DenseBlock_canAllocateSize Check if a dense block can allocate the specified size
+ * @param _this                      The dense block
+ * @param size                       Size requested by user
+ * @return                           True(1) or false(0)
+ *************************************************************************************************/
+static uint32_t DenseBlock_canAllocateSize(BlockHeader_t* _this, size_t size)
+{
+    uint32_t count = (size == 0) ? 1 : (size + DENSE_GRANULE - 1) / DENSE_GRANULE;
+
+    if (_this->usedSize + count * DENSE_GRANULE > DENSE_DATA_OFFSET + DENSE_GRANULES * DENSE_GRANULE)
+    {
+        return 0;
+    }
+
+    return DenseBlock_findFreeRegion(_this, 0, count) != DENSE_GRANULES;
+}
+
+/**
+ * @brief DenseBlock_allocateRegion Allocate a run of granules for use
+ * @param _this                     The dense block, NULL if none could be found
+ * @param size                      Size requested by user
+ * @param hint                      Address the run should follow as closely as possible, or NULL
+ * @return                          Payload address or NULL
+ *************************************************************************************************/
+static void* DenseBlock_allocateRegion(BlockHeader_t* _this, size_t size, void* hint)
+{
+    uint32_t      count = (size == 0) ? 1 : (size + DENSE_GRANULE - 1) / DENSE_GRANULE;
+    uint32_t      start = DENSE_GRANULES;
+    DenseTable_t* table;
+
+    if (_this == NULL)
+    {
+        return NULL;
+    }
+
+    table = DenseBlock_getTable(_this);
+
+    if (hint != NULL)
+    {
+        start = DenseBlock_findFreeRegion(_this, DenseBlock_toGranule(_this, hint), count);
+    }
+
+    if (start == DENSE_GRANULES)
+    {
+        start = DenseBlock_findFreeRegion(_this, 0, count);
+    }
+
+    if (start == DENSE_GRANULES)
+    {
+        return NULL;
+    }
+
+    Bitmap_fill(table->used,   start, count, 1);
+    Bitmap_fill(table->starts, start, 1,     1);
+
+    if (start == table->firstFree)
+    {
+        table->firstFree = Bitmap_find(table->used, start + count, DENSE_GRANULES, 0);
+    }
+
+    _this->usedSize += count * DENSE_GRANULE;
+    counterAdd(&_this->arena->usedSize,  count * DENSE_GRANULE);
+    counterAdd(&_this->arena->denseFree, -(size_t)(count * DENSE_GRANULE));
+
+    threadStats.allocated += count * DENSE_GRANULE;
+
+    return (void*)((uintptr_t)_this + DENSE_DATA_OFFSET + start * DENSE_GRANULE);
+}
+
+/**
+ * @brief DenseBlock_getPayloadSize Return the size of an allocation of a dense block: its granules
+ *                                  run up to the next allocation or the next free granule
+ * @param _this                     The dense block
+ * @param pointer                   Payload address returned to the user
+ * @return                          Size of the payload in bytes
+ *************************************************************************************************/
+static size_t DenseBlock_getPayloadSize(BlockHeader_t* _this, void* pointer)
+{
+    DenseTable_t* table = DenseBlock_getTable(_this);
+    uint32_t      start = DenseBlock_toGranule(_this, pointer);
+    uint32_t      end   = Bitmap_find(table->starts, start + 1, DENSE_GRANULES, 1);
+
+    end = Bitmap_find(table->used, start, end, 0);
+
+    return (end - start) * DENSE_GRANULE;
+}
+
+/**
+ * @brief DenseBlock_deallocateRegion Give the granules of an allocation back to a dense block
+ * @param _this                       The dense block
+ * @param pointer                     Payload address returned to the user
+ *************************************************************************************************/
+static void DenseBlock_deallocateRegion(BlockHeader_t* _this, void* pointer)
+{
+    DenseTable_t* table = DenseBlock_getTable(_this);
+    uint32_t      start = DenseBlock_toGranule(_this, pointer);
+    uint32_t      count;
+
+    // Not the start of an allocation: freed twice, or not returned by malloc
+    if ((uintptr_t)pointer < (uintptr_t)_this + DENSE_DATA_OFFSET ||
+        ((uintptr_t)pointer - (uintptr_t)_this - DENSE_DATA_OFFSET) % DENSE_GRANULE != 0 ||
+        Bitmap_find(table->starts, start, start + 1, 1) != start)
+    {
+        return;
+    }
+
+    count = DenseBlock_getPayloadSize(_this, pointer) / DENSE_GRANULE;
+
+    Bitmap_fill(table->used,   start, count, 0);
+    Bitmap_fill(table->starts, start, 1,     0);
+
+    if (start < table->firstFree)
+    {
+        table->firstFree = start;
+    }
+
+    table->missingRun = 0;
+
+    _this->usedSize -= count * DENSE_GRANULE;
+    counterAdd(&_this->arena->usedSize,  -(size_t)(count * DENSE_GRANULE));
+    counterAdd(&_this->arena->denseFree, count * DENSE_GRANULE);
+
+    threadStats.deallocated += count * DENSE_GRANULE;
+}
+
+/**
+ * @brief DenseBlock_iterate Walk the regions of a dense block through its side table
+ * @param _this              The dense block
+ * @param callback           Function called for each region
+ * @param ctx                User data given to callback
+ * @return                   0 if every region was visited, or what callback returned to stop the walk
+ *************************************************************************************************/
+static int DenseBlock_iterate(BlockHeader_t* _this, halloc_iterate_callback_t callback, void* ctx)
+{
+    DenseTable_t*   table = DenseBlock_getTable(_this);
+    uint32_t        start = 0;
+    halloc_region_t info;
+
+    info.block     = _this;
+    info.blockSize = _this->size;
+    info.tag       = _this->tag;
+    info.node      = _this->arena->node;
+    info.overhead  = 0;
+
+    while (start < DENSE_GRANULES)
+    {
+        uint32_t end;
+        int      stop;
+
+        if (Bitmap_find(table->used, start, start + 1, 1) == start)
+        {
+            end        = DenseBlock_getPayloadSize(_this, (void*)((uintptr_t)_this + DENSE_DATA_OFFSET + start * DENSE_GRANULE)) / DENSE_GRANULE + start;
+            info.state = HALLOC_REGION_USED;
+        }
+        else
+        {
+            end        = Bitmap_find(table->used, start, DENSE_GRANULES, 1);
+            info.state = HALLOC_REGION_FREE;
+        }
+
+        info.address = (void*)((uintptr_t)_this + DENSE_DATA_OFFSET + start * DENSE_GRANULE);
+        info.size    = (end - start) * DENSE_GRANULE;
+
+        stop = callback(&info, ctx);
+
+        if (stop != 0)
+        {
+            return stop;
+        }
+
+        start = end;
+    }
+
+    return 0;
+}
+
+#endif
+
+/*************************************************************************************************/
+/*********************************** Background worker *******************************************/
+
+/**
+ * @brief Background_wake Wake the background worker up before its period ends
+ *************************************************************************************************/
+static void Background_wake()
+{
+    __atomic_add_fetch(&backgroundSignal, 1, __ATOMIC_RELEASE);
+    libhalloc_wake(&backgroundSignal);
+}
+
+/**
+ * @brief ZeroClass_size Return the size of the regions of a class of the pre-zeroed pool
+ * @param index          Index of the class
+ * @return               Size in bytes
+ *************************************************************************************************/
+static size_t ZeroClass_size(uint32_t index)
+{
+    return (size_t)ZERO_POOL_MIN_SIZE << index;
+}
+
+/**
+ * @brief ZeroClass_put Keep a zeroed region ready in a class, or free it if the class is full. Only
+ *                      the background worker calls it.
+ * @param _this         The class
+ * @param region        The region, zeroed up to the class size
+ *************************************************************************************************/
+static void ZeroClass_put(ZeroClass_t* _this, void* region)
+{
+    spinLock(&_this->lock);
+
+    if (_this->count < ZERO_POOL_DEPTH)
+    {
+        _this->ready[_this->count++] = region;
+        region = NULL;
+    }
+
+    spinUnlock(&_this->lock);
+
+    free(region);
+}
+
+/**
+ * @brief ZeroPool_take Take a zeroed region for calloc
+ * @param size          Size requested by user
+ * @return              A region zeroed up to size, or NULL if there is none ready
+ *************************************************************************************************/
+static void* ZeroPool_take(size_t size)
+{
+    ZeroClass_t* zeroClass;
+    void*        region = NULL;
+    uint32_t     index  = 0;
+    uint32_t     empty;
+
+    if (__atomic_load_n(&backgroundState, __ATOMIC_RELAXED) != BACKGROUND_RUNNING)
+    {
+        return NULL;
+    }
+
+    while (index < ZERO_POOL_CLASSES && ZeroClass_size(index) < size)
+    {
+        index++;
+    }
+
+    if (index == ZERO_POOL_CLASSES)
+    {
+        return NULL;
+    }
+
+    zeroClass = &zeroClasses[index];
+
+    spinLock(&zeroClass->lock);
+
+    if (zeroClass->count > 0)
+    {
+        region = zeroClass->ready[--zeroClass->count];
+        zeroClass->hits++;
+    }
+    else
+    {
+        zeroClass->misses++;
+
+        if (zeroClass->wanted < ZERO_POOL_DEPTH)
+        {
+            zeroClass->wanted++;
+        }
+    }
+
+    empty = (zeroClass->count == 0);
+
+    spinUnlock(&zeroClass->lock);
+
+    // Allocated by the worker, but handed to this thread
+    if (region != NULL)
+    {
+        threadStats.allocated += getPayloadSize(region);
+    }
+
+    if (empty)
+    {
+        Background_wake();
+    }
+
+    return region;
+}
+
+/**
+ * @brief ZeroPool_recycle Hand a large allocation being freed to the background worker, if its class
+ *                         wants more regions. The worker zeroes it and keeps it ready for calloc.
+ * @param pointer          Payload address returned to the user
+ * @param payloadSize      Size of the payload
+ * @return                 True(1) if the worker took the allocation, false(0) if it must be freed
+ *************************************************************************************************/
+static uint32_t ZeroPool_recycle(void* pointer, size_t payloadSize)
+{
+    ZeroClass_t* zeroClass;
+    uint32_t     index = 0;
+    uint32_t     taken = 0;
+    void*        head;
+
+    if (payloadSize < ZERO_POOL_MIN_SIZE || backgroundThread ||
+        __atomic_load_n(&backgroundState, __ATOMIC_RELAXED) != BACKGROUND_RUNNING)
+    {
+        return 0;
+    }
+
+    // The largest class it can serve, far bigger allocations are not kept
+    while (index + 1 < ZERO_POOL_CLASSES && ZeroClass_size(index + 1) <= payloadSize)
+    {
+        index++;
+    }
+
+    if (payloadSize >= ZeroClass_size(index) * 2)
+    {
+        return 0;
+    }
+
+    zeroClass = &zeroClasses[index];
+
+    spinLock(&zeroClass->lock);
+
+    if (zeroClass->count + zeroClass->pending < zeroClass->wanted)
+    {
+        zeroClass->pending++;
+        taken = 1;
+    }
+
+    spinUnlock(&zeroClass->lock);
+
+    if (!taken)
+    {
+        return 0;
+    }
+
+    threadStats.deallocated += payloadSize;
+
+    head = __atomic_load_n(&dirtyRegions, __ATOMIC_RELAXED);
+
+    do
+    {
+        *(void**)pointer = head;
+    }
+    while (!__atomic_compare_exchange_n(&dirtyRegions, &head, pointer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    Background_wake();
+
+    return 1;
+}
+
+/**
+ * @brief ZeroPool_refill Zero the regions freed to the pool, then allocate and zero new ones until
+ *                        every class has the regions it wants. Only the background worker calls it.
+ *************************************************************************************************/
+static void ZeroPool_refill()
+{
+    void*    dirty = __atomic_exchange_n(&dirtyRegions, NULL, __ATOMIC_ACQUIRE);
+    uint32_t index;
+
+    while (dirty != NULL)
+    {
+        void*    next = *(void**)dirty;
+        size_t   size = getPayloadSize(dirty);
+
+        for (index = 0; index + 1 < ZERO_POOL_CLASSES && ZeroClass_size(index + 1) <= size; index++)
+        {
+        }
+
+        memset(dirty, 0, ZeroClass_size(index));
+
+        // A region freed while the worker stopped was not counted again when it restarted
+        spinLock(&zeroClasses[index].lock);
+        zeroClasses[index].pending -= (zeroClasses[index].pending > 0);
+        spinUnlock(&zeroClasses[index].lock);
+
+        ZeroClass_put(&zeroClasses[index], dirty);
+
+        dirty = next;
+    }
+
+    for (index = 0; index < ZERO_POOL_CLASSES; index++)
+    {
+        ZeroClass_t* zeroClass = &zeroClasses[index];
+
+        while (__atomic_load_n(&zeroClass->count, __ATOMIC_RELAXED) < __atomic_load_n(&zeroClass->wanted, __ATOMIC_RELAXED))
+        {
+            void* region = malloc(ZeroClass_size(index));
+
+            if (region == NULL)
+            {
+                break;
+            }
+
+            memset(region, 0, ZeroClass_size(index));
+            ZeroClass_put(zeroClass, region);
+        }
+    }
+}
+
+/**
+ * @brief ZeroPool_drain Free every region of the pool, and forget the sizes it wanted. Only the
+ *                       background worker calls it, once it stopped taking regions.
+ *************************************************************************************************/
+static void ZeroPool_drain()
+{
+    void*    dirty = __atomic_exchange_n(&dirtyRegions, NULL, __ATOMIC_ACQUIRE);
+    uint32_t index;
+
+    while (dirty != NULL)
+    {
+        void* next = *(void**)dirty;
+
+        free(dirty);
+        dirty = next;
+    }
+
+    for (index = 0; index < ZERO_POOL_CLASSES; index++)
+    {
+        ZeroClass_t* zeroClass = &zeroClasses[index];
+
+        spinLock(&zeroClass->lock);
+
+        while (zeroClass->count > 0)
+        {
+            void* region = zeroClass->ready[--zeroClass->count];
+
+            spinUnlock(&zeroClass->lock);
+            free(region);
+            spinLock(&zeroClass->lock);
+        }
+
+        zeroClass->wanted  = 0;
+        zeroClass->pending = 0;
+
+        spinUnlock(&zeroClass->lock);
+    }
+}
+
+/**
+ * @brief Arena_refillReserve Map and fault in mappings until the reserve of the arena is full. Only
+ *                            the background worker calls it.
+ * @param _this               The arena
+ *************************************************************************************************/
+static void Arena_refillReserve(Arena_t* _this)
+{
+    while (__atomic_load_n(&_this->reserveCount, __ATOMIC_RELAXED) < RESERVE_BLOCKS)
+    {
+        void*  memory = (arenaCount > 1) ? libhalloc_alloc_node(RESERVE_PAGES, _this->node) : libhalloc_alloc(RESERVE_PAGES);
+        size_t offset;
+
+        __atomic_add_fetch(&mapCalls, 1, __ATOMIC_RELAXED);
+
+        if (memory == NULL)
+        {
+            return;
+        }
+
+        // Faulted in here rather than by the thread which gets them
+        for (offset = 0; offset < RESERVE_PAGES * PAGE_SIZE; offset += PAGE_SIZE)
+        {
+            ((volatile char*)memory)[offset] = 0;
+        }
+
+        spinLock(&_this->reserveLock);
+
+        if (_this->reserveCount < RESERVE_BLOCKS)
+        {
+            _this->reserve[_this->reserveCount++] = memory;
+            memory = NULL;
+        }
+
+        spinUnlock(&_this->reserveLock);
+
+        if (memory != NULL)
+        {
+            libhalloc_free(memory, RESERVE_PAGES);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Arena_drainReserve Give every mapping of the reserve of the arena back to the kernel
+ * @param _this              The arena
+ *************************************************************************************************/
+static void Arena_drainReserve(Arena_t* _this)
+{
+    spinLock(&_this->reserveLock);
+
+    while (_this->reserveCount > 0)
+    {
+        libhalloc_free(_this->reserve[--_this->reserveCount], RESERVE_PAGES);
+    }
+
+    spinUnlock(&_this->reserveLock);
+}
+
+/**
+ * @brief History_record Add a sample to the statistics history if the interval elapsed since the last
+ *                       one. Only the background worker calls it.
+ * @param now            Current time
+ *************************************************************************************************/
+static void History_record(uint64_t now)
+{
+    uint64_t                interval = __atomic_load_n(&historyInterval, __ATOMIC_RELAXED);
+    uint64_t                index    = historyWritten;
+    HistorySlot_t*          slot     = &historySlots[index % HALLOC_HISTORY_SAMPLES];
+    uint32_t                count    = __atomic_load_n(&arenaCount, __ATOMIC_ACQUIRE);
+    uint64_t                maps;
+    uint32_t                i;
+    halloc_history_sample_t sample;
+
+    if (interval == 0 || (index > 0 && now - historyLast < interval))
+    {
+        return;
+    }
+
+    memset(&sample, 0, sizeof(sample));
+    sample.time = now;
+
+    for (i = 0; i < count; i++)
+    {
+        sample.mapped += __atomic_load_n(&arenas[i].size,     __ATOMIC_RELAXED);
+        sample.active += __atomic_load_n(&arenas[i].usedSize, __ATOMIC_RELAXED);
+        sample.blocks += __atomic_load_n(&arenas[i].blocks,   __ATOMIC_RELAXED);
+    }
+
+    // The counters are not read together, active may be ahead of mapped for a moment
+    if (sample.mapped > sample.active)
+    {
+        sample.fragmentation = (sample.mapped - sample.active) * 1000 / sample.mapped;
+    }
+
+    maps = __atomic_load_n(&mapCalls, __ATOMIC_RELAXED);
+
+    if (index > 0 && now > historyLast)
+    {
+        sample.mapsPerSecond = (maps - historyLastMaps) * 1000000000ull / (now - historyLast);
+    }
+
+    __atomic_store_n(&slot->sequence, 2 * index + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->sample = sample;
+
+    __atomic_store_n(&slot->sequence, 2 * index + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&historyWritten, index + 1, __ATOMIC_RELEASE);
+
+    historyLast     = now;
+    historyLastMaps = maps;
+}
+
+/**
+ * @brief Background_run Body of the background worker: work, then sleep until woken up or until its
+ *                       period ends, as long as it is not stopped
+ * @param arg            Unused
+ * @return               NULL
+ *************************************************************************************************/
+static void* Background_run(void* arg)
+{
+    uint32_t i;
+
+    backgroundThread = 1;
+
+    while (__atomic_load_n(&backgroundState, __ATOMIC_ACQUIRE) == BACKGROUND_RUNNING)
+    {
+        uint32_t signal = __atomic_load_n(&backgroundSignal, __ATOMIC_ACQUIRE);
+        uint32_t count  = __atomic_load_n(&arenaCount, __ATOMIC_ACQUIRE);
+
+        for (i = 0; i < count; i++)
+        {
+            Arena_refillReserve(&arenas[i]);
+        }
+
+        ZeroPool_refill();
+        History_record(libhalloc_clock());
+        Hooks_flush();
+
+        libhalloc_wait(&backgroundSignal, signal, BACKGROUND_PERIOD);
+    }
+
+    ZeroPool_drain();
+
+    for (i = 0; i < MAX_ARENAS; i++)
+    {
+        Arena_drainReserve(&arenas[i]);
+    }
+
+    Hooks_flush();
+
+    __atomic_store_n(&backgroundState, BACKGROUND_STOPPED, __ATOMIC_RELEASE);
+    libhalloc_wake(&backgroundState);
+
+    return NULL;
+}
+
+/*************************************************************************************************/
+/*********************************** Statistics export *******************************************/
+
+/**
+ * @brief TextBuffer_append Append formatted text. Only integers and strings are formatted, which
+ *                          vsnprintf does without allocating.
+ * @param _this             The text buffer
+ * @param format            printf format
+ *************************************************************************************************/
+static void TextBuffer_append(TextBuffer_t* _this, const char* format, ...)
+{
+    size_t  room = (_this->length < _this->size) ? _this->size - _this->length : 0;
+    va_list args;
+    int     written;
+
+    va_start(args, format);
+    written = vsnprintf((room > 0) ? _this->data + _this->length : NULL, room, format, args);
+    va_end(args);
+
+    if (written > 0)
+    {
+        _this->length += written;
+    }
+}
+
+/**
+ * @brief TextBuffer_family Append the header of a metric family in the Prometheus text format
+ * @param _this             The text buffer
+ * @param name              Name of the family, without the halloc_ prefix
+ * @param type              counter, gauge or histogram
+ * @param help              Description of the family
+ *************************************************************************************************/
+static void TextBuffer_family(TextBuffer_t* _this, const char* name, const char* type, const char* help)
+{
+    TextBuffer_append(_this, "# HELP halloc_%s %s\n# TYPE halloc_%s %s\n", name, help, name, type);
+}
+
+/**
+ * @brief TextBuffer_arenaFamily Append a metric family with one sample per arena, taken from a
+ *                               counter of the arenas
+ * @param _this                  The text buffer
+ * @param name                   Name of the family, without the halloc_ prefix
+ * @param type                   counter or gauge
+ * @param help                   Description of the family
+ * @param offset                 Offset of the counter in Arena_t
+ * @param width                  Size of the counter, 4 or 8 bytes
+ *************************************************************************************************/
+static void TextBuffer_arenaFamily(TextBuffer_t* _this, const char* name, const char* type, const char* help, size_t offset, size_t width)
+{
+    uint32_t count = __atomic_load_n(&arenaCount, __ATOMIC_ACQUIRE);
+    uint32_t i;
+
+    TextBuffer_family(_this, name, type, help);
+
+    for (i = 0; i < count; i++)
+    {
+        void*    counter = (char*)&arenas[i] + offset;
+        uint64_t value   = (width == sizeof(uint32_t)) ? __atomic_load_n((uint32_t*)counter, __ATOMIC_RELAXED)
+                                                       : __atomic_load_n((uint64_t*)counter, __ATOMIC_RELAXED);
+
+        TextBuffer_append(_this, "halloc_%s{arena=\"%u\",node=\"%u\"} %llu\n", name, i, arenas[i].node, (unsigned long long)value);
+    }
+}
+
+/**
+ * @brief TextBuffer_classSample Append a sample of an arena for a class of the free lists, labelled
+ *                               with the largest region size of the class
+ * @param _this                  The text buffer
+ * @param name                   Name of the family, without the halloc_ prefix
+ * @param arena                  Index of the arena
+ * @param index                  Free list index of the class
+ * @param value                  The sample
+ *************************************************************************************************/
+static void TextBuffer_classSample(TextBuffer_t* _this, const char* name, uint32_t arena, uint32_t index, uint64_t value)
+{
+    TextBuffer_append(_this, "halloc_%s{arena=\"%u\",node=\"%u\",class=\"", name, arena, arenas[arena].node);
+
+    if (index == LARGE_FREE_BLOCK_INDEX)
+    {
+        TextBuffer_append(_this, "+Inf");
+    }
+    else
+    {
+        TextBuffer_append(_this, "%u", freeListLimits[index]);
+    }
+
+    TextBuffer_append(_this, "\"} %llu\n", (unsigned long long)value);
+}
+
+/**
+ * @brief TextBuffer_seconds Append a time in seconds, from nanoseconds, without floating point
+ * @param _this              The text buffer
+ * @param nanoseconds        The time
+ *************************************************************************************************/
+static void TextBuffer_seconds(TextBuffer_t* _this, uint64_t nanoseconds)
+{
+    TextBuffer_append(_this, "%llu.%09llu", (unsigned long long)(nanoseconds / 1000000000ull), (unsigned long long)(nanoseconds % 1000000000ull));
+}
+
+/*************************************************************************************************/
+/*********************************** Allocation hooks ********************************************/
+
+/**
+ * @brief Hooks_blockEvent Keep a block event until the calling thread releases its locks, as the hooks
+ *                         may allocate. Events past HOOK_PENDING_EVENTS are not reported.
+ * @param block            The heap block
+ * @param mapped           Mapped(1) or unmapped(0)
+ *************************************************************************************************/
+static void Hooks_blockEvent(BlockHeader_t* block, uint32_t mapped)
+{
+    HookEvent_t* event;
+
+    if (hookDepth != 0 || pendingEventCount == HOOK_PENDING_EVENTS)
+    {
+        return;
+    }
+
+    event          = &pendingEvents[pendingEventCount++];
+    event->address = block;
+    event->size    = block->size;
+    event->kind    = mapped ? HOOK_EVENT_MAP : HOOK_EVENT_UNMAP;
+}
+
+/**
+ * @brief Hooks_freeEvent Keep the free of an allocation of a block released by halloc_free_tag, a
+ *                        halloc_iterate_callback_t. Stops the walk when no more events can be kept.
+ * @param region          Region of the block
+ * @param ctx             The HookFreeWalk_t of the block
+ * @return                0 to go on, 1 if the walk must resume from walk->resume
+ *************************************************************************************************/
+static int Hooks_freeEvent(const halloc_region_t* region, void* ctx)
+{
+    HookFreeWalk_t* walk = (HookFreeWalk_t*) ctx;
+    HookEvent_t*    event;
+
+    if (region->state != HALLOC_REGION_USED || (uintptr_t)region->address < walk->resume)
+    {
+        return 0;
+    }
+
+    if (pendingEventCount == HOOK_PENDING_EVENTS)
+    {
+        walk->resume = (uintptr_t)region->address;
+        return 1;
+    }
+
+    event          = &pendingEvents[pendingEventCount++];
+    event->address = region->address;
+    event->size    = 0;
+    event->kind    = HOOK_EVENT_FREE;
+
+    return 0;
+}
+
+/**
+ * @brief Hooks_flush Report the events kept by the calling thread, which holds no lock anymore
+ *************************************************************************************************/
+static void Hooks_flush()
+{
+    const halloc_hooks_t* table = __atomic_load_n(&hookTable, __ATOMIC_ACQUIRE);
+    HookEvent_t           events[HOOK_PENDING_EVENTS];
+    uint32_t              count = pendingEventCount;
+    uint32_t              i;
+
+    if (count == 0 || hookDepth != 0)
+    {
+        return;
+    }
+
+    // Copied out first, the hooks may add events of their own
+    memcpy(events, pendingEvents, count * sizeof(HookEvent_t));
+    pendingEventCount = 0;
+
+    if (table == NULL)
+    {
+        return;
+    }
+
+    hookDepth++;
+
+    for (i = 0; i < count; i++)
+    {
+        if (events[i].kind == HOOK_EVENT_FREE)
+        {
+            if (table->onFree != NULL)
+            {
+                table->onFree(events[i].address, table->ctx);
+            }
+        }
+        else
+        {
+            void (*hook)(void*, size_t, void*) = (events[i].kind == HOOK_EVENT_MAP) ? table->onBlockMap : table->onBlockUnmap;
+
+            if (hook != NULL)
+            {
+                hook(events[i].address, events[i].size, table->ctx);
+            }
+        }
+    }
+
+    hookDepth--;
+}
+
+/**
+ * @brief Hooks_allocated Report an allocation, after the block events it caused
+ * @param payload         The allocation, nothing is reported if it is NULL
+ * @param size            Size requested
+ *************************************************************************************************/
+static void Hooks_allocated(void* payload, size_t size)
+{
+    const halloc_hooks_t* table = __atomic_load_n(&hookTable, __ATOMIC_ACQUIRE);
+
+    Hooks_flush();
+
+    // The regions the background worker allocates for itself are not the application's
+    if (table == NULL || table->onAlloc == NULL || payload == NULL || hookDepth != 0 || backgroundThread)
+    {
+        return;
+    }
+
+    hookDepth++;
+    table->onAlloc(payload, size, table->ctx);
+    hookDepth--;
+}
+
+/**
+ * @brief Hooks_freed Report a free, after the block events it caused
+ * @param pointer     The allocation, no longer valid
+ *************************************************************************************************/
+static void Hooks_freed(void* pointer)
+{
+    const halloc_hooks_t* table = __atomic_load_n(&hookTable, __ATOMIC_ACQUIRE);
+
+    Hooks_flush();
+
+    if (table == NULL || table->onFree == NULL || hookDepth != 0 || backgroundThread)
+    {
+        return;
+    }
+
+    hookDepth++;
+    table->onFree(pointer, table->ctx);
+    hookDepth--;
+}
+
+/**
+ * @brief Hooks_reallocated Report a reallocation, after the block events it caused
+ * @param pointer           The former allocation
+ * @param payload           The new allocation, nothing is reported if it is NULL
+ * @param size              Size requested
+ *************************************************************************************************/
+static void Hooks_reallocated(void* pointer, void* payload, size_t size)
+{
+    const halloc_hooks_t* table = __atomic_load_n(&hookTable, __ATOMIC_ACQUIRE);
+
+    Hooks_flush();
+
+    if (table == NULL || table->onRealloc == NULL || payload == NULL || hookDepth != 0 || backgroundThread)
+    {
+        return;
+    }
+
+    hookDepth++;
+    table->onRealloc(pointer, payload, size, table->ctx);
+    hookDepth--;
+}
+
+/*************************************************************************************************/
+/*********************************** Heap iteration **********************************************/
+
+/**
+ * @brief Block_iterate Walk the regions of a heap block through their boundary tags
+ * @param _this         Heap block to be walked
+ * @param callback      Function called for each region
+ * @param ctx           User data given to callback
+ * @return              0 if every region was visited, or what callback returned to stop the walk
+ *************************************************************************************************/
+static int Block_iterate(BlockHeader_t* _this, halloc_iterate_callback_t callback, void* ctx)
+{
+    uintptr_t       regionAddr = (uintptr_t)_this + sizeof(BlockHeader_t);
+    uintptr_t       blockEnd   = (uintptr_t)_this + _this->size;
+    halloc_region_t info;
+
+    if (Block_isDense(_this))
+    {
+        return DenseBlock_iterate(_this, callback, ctx);
+    }
+
+    info.block     = _this;
+    info.blockSize = _this->size;
+    info.tag       = _this->tag;
+    info.node      = _this->arena->node;
+    info.overhead  = REGION_OVERHEAD_SIZE;
+
+    while (regionAddr < blockEnd)
+    {
+        AllocMetadata_t* header = (AllocMetadata_t*) regionAddr;
+        int              stop;
+
+        if (header->size == 0)
+        {
+            return -1; // Corrupted boundary tag, the walk can not go on
+        }
+
+        info.address = (void*)(regionAddr + sizeof(AllocMetadata_t));
+        info.size    = REGION_PAYLOAD_SIZE(header->size);
+
+        if (regionAddr == (uintptr_t)_this + sizeof(BlockHeader_t))
+        {
+            info.state = HALLOC_REGION_INTERNAL; // Alignment region made by createHeapBlock
+        }
+        else
+        {
+            info.state = (header->used != 0) ? HALLOC_REGION_USED : HALLOC_REGION_FREE;
+        }
+
+        stop = callback(&info, ctx);
+
+        if (stop != 0)
+        {
+            return stop;
+        }
+
+        regionAddr += header->size;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Block_addUsedSize Add the payload of a used region to a total, a halloc_iterate_callback_t
+ * @param region            Region of the block
+ * @param ctx               The size_t total
+ * @return                  0, to go on
+ *************************************************************************************************/
+static int Block_addUsedSize(const halloc_region_t* region, void* ctx)
+{
+    if (region->state == HALLOC_REGION_USED)
+    {
+        *(size_t*)ctx += region->size;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief deallocate Give an allocation back to its heap block. The heap lock must be held, except in
+ *                   fine-grained mode, where the block is locked here.
+ * @param pointer    Payload address returned to the user
+ *************************************************************************************************/
+static void deallocate(void* pointer)
+{
+    AllocMetadata_t* allocatedRegion = (AllocMetadata_t*) (pointer - sizeof(AllocMetadata_t));
+    BlockHeader_t*   block           = NULL;
+
+    block = getBlockWithRegion(pointer);
+
+    if (block == NULL)
+    {
+        return; // Error
+    }
+
+    // The bytes before a payload of a dense block belong to the previous one
+    if (Block_isDense(block))
+    {
+        DenseBlock_deallocateRegion(block, pointer);
+    }
+    else if (allocatedRegion->used != 0)
+    {
+        if (allocatedRegion->used & REGION_TRACKED)
+        {
+            CallSite_freed(allocatedRegion);
+        }
+        // Large allocations may go to the background worker, zeroed for the next callocs
+        else if (block->tag == 0 && ZeroPool_recycle(pointer, REGION_PAYLOAD_SIZE(allocatedRegion->size)))
+        {
+            Block_unlockWithArena(block);
+            return;
+        }
+
+        Block_deallocateRegion(block, allocatedRegion);
+    }
+
+    // If the block does not contains user Allocations
+    // return it to the kernel
+    if (Block_haveUserAllocations(block) == 0)
+    {
+        Arena_t* arena = block->arena;
+
+        Block_unlockWithArena(block);
+        Arena_lockExclusive(arena);
+
+        // Another thread may have allocated from it, or released it, in between
+        if (Arena_hasBlock(arena, block) && Block_haveUserAllocations(block) == 0)
+        {
+            Arena_releaseBlock(arena, block);
+        }
+
+        Arena_unlockExclusive(arena);
+        return;
+    }
+
+    Arena_touchBlock(block->arena, block);
+    Block_unlockWithArena(block);
+}
+
+/**
+ * @brief allocate Allocate a region of the heap
+ * @param size     Size of the payload
+ * @return         Payload address, NULL if there is no memory
+ *************************************************************************************************/
+static void* allocate(size_t size)
+{
+    BlockHeader_t*   block     = NULL;
+    AllocMetadata_t* memoryPtr = NULL;
+
+    if (lockBlocks() != 0)
+    {
+        return 0;
+    }
+
+    if (isDenseSize(size))
+    {
+        void* payload;
+
+        block   = getBlockWithFreeRegion(size, 0, 1);
+        payload = DenseBlock_allocateRegion(block, size, NULL);
+
+        Block_unlockWithArena(block);
+        unlockBlocks();
+
+        return payload;
+    }
+
+    block = getBlockWithFreeRegion(size, 0, 0);
+
+    memoryPtr = Block_allocateRegion(block, size);
+
+    Block_unlockWithArena(block);
+    unlockBlocks();
+
+    if (memoryPtr == NULL)
+    {
+        return 0;
+    }
+
+    return (void*)(memoryPtr) + sizeof(AllocMetadata_t);
+}
+
+/**
+ * @brief allocateNear Allocate in the free region nearest to an address, inside the heap block holding it
+ * @param hint         The address
+ * @param size         Size of the payload
+ * @return             Payload address, NULL if hint is not in the heap or its block has no room
+ *************************************************************************************************/
+static void* allocateNear(void* hint, size_t size)
+{
+    BlockHeader_t*   block     = NULL;
+    AllocMetadata_t* memoryPtr = NULL;
+    void*            payload   = NULL;
+
+    if (lockBlocks() != 0)
+    {
+        return NULL;
+    }
+
+    block = getBlockWithRegion(hint);
+
+    if (Block_isDense(block))
+    {
+        payload = isDenseSize(size) ? DenseBlock_allocateRegion(block, size, hint) : NULL;
+    }
+    // Tagged blocks are released as a whole, they only hold allocations of their tag
+    else if (block != NULL && block->tag == 0)
+    {
+        memoryPtr = Block_allocateRegionNear(block, size, hint);
+        payload   = (memoryPtr != NULL) ? (void*)(memoryPtr) + sizeof(AllocMetadata_t) : NULL;
+    }
+
+    Block_unlockWithArena(block);
+    unlockBlocks();
+
+    return payload;
+}
+
+/**
+ * @brief allocateInStream Allocate next to the previous allocation of the stream of a call site, so
+ *                         the objects of a site are clustered in the same blocks
+ * @param size             Size of the payload
+ * @param site             Return address of the caller
+ * @param streams          Streams in use
+ * @return                 Payload address, NULL if there is no memory
+ *************************************************************************************************/
+static void* allocateInStream(size_t size, const void* site, uint32_t streams)
+{
+    uint32_t hash    = (uint32_t)(((uintptr_t)site >> 2) * 2654435761u);
+    uint32_t index   = (uint32_t)(((uint64_t)hash * streams) >> 32);
+    void*    cursor  = streamCursors[index];
+    void*    payload = (cursor != NULL) ? allocateNear(cursor, size) : NULL;
+
+    // The block of the stream is full, the stream goes on wherever this one lands
+    if (payload == NULL)
+    {
+        payload = allocate(size);
+    }
+
+    if (payload != NULL)
+    {
+        streamCursors[index] = payload;
+    }
+
+    return payload;
+}
+
+/**
+ * @brief release Free an allocation
+ * @param pointer Payload address returned to the user
+ *************************************************************************************************/
+static void release(void* pointer)
+{
+    if (lockBlocks() != 0)
+    {
+        return;
+    }
+
+    deallocate(pointer);
+
+    unlockBlocks();
+}
+
+/*************************************************************************************************/
+/*********************************** Public interface functions **********************************/
+
+/**
+ * @brief malloc
+ * @param size
+ * @return
+ *************************************************************************************************/
+void* malloc(size_t size)
+{
+    uint32_t streams = __atomic_load_n(&streamCount, __ATOMIC_RELAXED);
+    void*    payload = (streams != 0) ? allocateInStream(size, __builtin_return_address(0), streams) : allocate(size);
+
+    if (__atomic_load_n(&hookTable, __ATOMIC_RELAXED) != NULL)
+    {
+        Hooks_allocated(payload, size);
+    }
+
+    return payload;
+}
+
+/**
+ * @brief realloc
+ * @param pointer
+ * @param size
+ * @return
+ *************************************************************************************************/
+void* realloc(void* pointer, size_t size)
+{
+    size_t           payloadLength;
+    size_t           copyLength;
+    void*            newMemoryPtr;
+
+    if (pointer == NULL)
+    {
+        return malloc(size);
+    }
+
+    payloadLength = getPayloadSize(pointer);
+    copyLength    = payloadLength;
+
+    if (payloadLength == size)
+    {
+        if (__atomic_load_n(&hookTable, __ATOMIC_RELAXED) != NULL)
+        {
+            Hooks_reallocated(pointer, pointer, size);
+        }
+
+        return pointer;
+    }
+
+    if (size < payloadLength)
+    {
+        copyLength = size;
+    }
+
+    newMemoryPtr = allocate(size);
+
+    if (newMemoryPtr == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(newMemoryPtr, pointer, copyLength);
+    release(pointer);
+
+    if (__atomic_load_n(&hookTable, __ATOMIC_RELAXED) != NULL)
+    {
+        Hooks_reallocated(pointer, newMemoryPtr, size);
+    }
+
+    return newMemoryPtr;
+}
+
+/**
+ * @brief calloc
+ * @param num
+ * @param size
+ * @return
+ *************************************************************************************************/
+void* calloc(size_t num, size_t size)
+{
+    void*            memoryPtr;
+    size_t           payloadLength;
+
+    if (size == 0)
+    {
+        return NULL;
+    }
+
+    // Zeroed ahead of time by the background worker
+    if (num*size >= ZERO_POOL_MIN_SIZE && (memoryPtr = ZeroPool_take(num*size)) != NULL)
+    {
+        if (__atomic_load_n(&hookTable, __ATOMIC_RELAXED) != NULL)
+        {
+            Hooks_allocated(memoryPtr, num*size);
+        }
+
+        return memoryPtr;
+    }
+
+    memoryPtr     = malloc(num*size);
+
+    if (memoryPtr == NULL)
+    {
+        return NULL;
+    }
+
+    payloadLength = getPayloadSize(memoryPtr);
+
+    memset(memoryPtr, 0, payloadLength);
+
+    return memoryPtr;
+}
+
+/**
+ * @brief free
+ * @param pointer
+ *************************************************************************************************/
+void free(void* pointer)
+{
+    if (pointer == NULL)
+    {
+        return;
+    }
+
+    release(pointer);
+
+    if (__atomic_load_n(&hookTable, __ATOMIC_RELAXED) != NULL)
+    {
+        Hooks_freed(pointer);
+    }
+}
+
+/**
+ * @brief halloc_free_batch Free a chain of allocations linked through their first word
+ * @param chain             First allocation of the chain
+ *************************************************************************************************/
+void halloc_free_batch(void* chain)
+{
+    const halloc_hooks_t* table = __atomic_load_n(&hookTable, __ATOMIC_RELAXED);
+    void*                 it;
+
+    if (chain == NULL)
+    {
+        return;
+    }
+
+    // Reported first, the links are lost once the allocations are freed
+    for (it = chain; table != NULL && it != NULL; it = *(void**)it)
+    {
+        Hooks_freed(it);
+    }
+
+    if (lockBlocks() != 0)
+    {
+        return;
+    }
+
+    while (chain != NULL)
+    {
+        void* next = *(void**)chain;
+
+        deallocate(chain);
+        chain = next;
+    }
+
+    unlockBlocks();
+
+    if (table != NULL)
+    {
+        Hooks_flush();
+    }
+}
+
+/**
+ * @brief halloc_malloc_site
+ * @param size
+ * @param site
+ * @return
+ *************************************************************************************************/
+void* halloc_malloc_site(size_t size, const char* site)
+{
+    const void*        key       = (site != NULL) ? (const void*)site : __builtin_return_address(0);
+    BlockHeader_t*     block     = NULL;
+    AllocMetadata_t*   memoryPtr = NULL;
+    AllocMetadata_t*   footer;
+    CallSiteTrailer_t* trailer;
+    uint32_t           index     = CallSite_lookup(key, site);
+
+    if (lockBlocks() != 0)
+    {
+        return 0;
+    }
+
+    block     = getBlockWithFreeRegion(size + sizeof(CallSiteTrailer_t), 0, 0);
+    memoryPtr = Block_allocateRegion(block, size + sizeof(CallSiteTrailer_t));
+
+    if (memoryPtr == NULL)
+    {
+        Block_unlockWithArena(block);
+        unlockBlocks();
+        return 0;
+    }
+
+    footer  = (AllocMetadata_t*)((uintptr_t)memoryPtr + memoryPtr->size - sizeof(AllocMetadata_t));
+    trailer = (CallSiteTrailer_t*)((uintptr_t)footer - sizeof(CallSiteTrailer_t));
+
+    trailer->site    = index;
+    trailer->size    = size;
+    memoryPtr->used |= REGION_TRACKED;
+    footer->used    |= REGION_TRACKED;
+
+    Block_unlockWithArena(block);
+    unlockBlocks();
+
+    CallSite_allocated(index, size);
+
+    if (__atomic_load_n(&hookTable, __ATOMIC_RELAXED) != NULL)
+    {
+        Hooks_allocated((void*)(memoryPtr) + sizeof(AllocMetadata_t), size);
+    }
+
+    return (void*)(memoryPtr) + sizeof(AllocMetadata_t);
+}
+
+/**
+ * @brief halloc_site_stats
+ * @param index
+ * @param stats
+ * @return
+ *************************************************************************************************/
+int halloc_site_stats(uint32_t index, halloc_site_stats_t* stats)
+{
+    CallSite_t* site;
+    const void* key;
+
+    if (index >= CALL_SITES || stats == NULL)
+    {
+        return -1;
+    }
+
+    site = &callSites[index];
+    key  = __atomic_load_n(&site->key, __ATOMIC_ACQUIRE);
+
+    if (key == NULL || key == CALL_SITE_CLAIMED)
+    {
+        return -1;
+    }
+
+    stats->key       = key;
+    stats->name      = site->name;
+    stats->count     = __atomic_load_n(&site->count,     __ATOMIC_RELAXED);
+    stats->liveBytes = __atomic_load_n(&site->liveBytes, __ATOMIC_RELAXED);
+    stats->peakBytes = __atomic_load_n(&site->peakBytes, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/**
+ * @brief halloc_iterate
+ * @param callback
+ * @param ctx
+ * @return
+ *************************************************************************************************/
+int halloc_iterate(halloc_iterate_callback_t callback, void* ctx)
+{
+    BlockHeader_t* block;
+    uint32_t       i;
+    int            stop = 0;
+
+    if (callback == NULL)
+    {
+        return 0;
+    }
+
+    if (lockHeap() != 0)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < arenaCount && stop == 0; i++)
+    {
+        for (block = arenas[i].blockList; block != NULL && stop == 0; block = block->next)
+        {
+            stop = Block_iterate(block, callback, ctx);
+        }
+    }
+
+    unlockHeap();
+
+    return stop;
+}
+
+/**
+ * @brief halloc_malloc_tagged
+ * @param tag
+ * @param size
+ * @return
+ *************************************************************************************************/
+void* halloc_malloc_tagged(uintptr_t tag, size_t size)
+{
+    BlockHeader_t*   block     = NULL;
+    AllocMetadata_t* memoryPtr = NULL;
+
+    if (lockBlocks() != 0)
+    {
+        return 0;
+    }
+
+    block = getBlockWithFreeRegion(size, tag, 0);
+
+    memoryPtr = Block_allocateRegion(block, size);
+
+    Block_unlockWithArena(block);
+    unlockBlocks();
+
+    if (__atomic_load_n(&hookTable, __ATOMIC_RELAXED) != NULL)
+    {
+        Hooks_allocated((memoryPtr != NULL) ? (void*)(memoryPtr) + sizeof(AllocMetadata_t) : NULL, size);
+    }
+
+    if (memoryPtr == NULL)
+    {
+        return 0;
+    }
+
+    return (void*)(memoryPtr) + sizeof(AllocMetadata_t);
+}
+
+/**
+ * @brief halloc_free_tag
+ * @param tag
+ * @return
+ *************************************************************************************************/
+size_t halloc_free_tag(uintptr_t tag)
+{
+    const halloc_hooks_t* table = __atomic_load_n(&hookTable, __ATOMIC_ACQUIRE);
+    HookFreeWalk_t        walk  = { NULL, 0 };
+    BlockHeader_t*        block;
+    BlockHeader_t*        next;
+    size_t                usedSize;
+    size_t                count = 0;
+    uint32_t              i;
+
+    if (tag == 0)
+    {
+        return 0;
+    }
+
+    if (lockHeap() != 0)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < arenaCount; i++)
+    {
+        for (block = arenas[i].blockList; block != NULL; block = next)
+        {
+            next = block->next;
+
+            if (block->tag != tag)
+            {
+                continue;
+            }
+
+            // The allocations of the block are reported freed before it is, a few at a time
+            if (table != NULL && table->onFree != NULL && hookDepth == 0)
+            {
+                if (walk.block != block)
+                {
+                    walk.block  = block;
+                    walk.resume = 0;
+                }
+
+                if (Block_iterate(block, Hooks_freeEvent, &walk) != 1)
+                {
+                    walk.resume = UINTPTR_MAX;
+                }
+            }
+
+            // The events are reported without the locks, the walk starts over and resumes
+            if (pendingEventCount == HOOK_PENDING_EVENTS && hookDepth == 0)
+            {
+                unlockHeap();
+                Hooks_flush();
+
+                if (lockHeap() != 0)
+                {
+                    return count;
+                }
+
+                next = arenas[i].blockList;
+                continue;
+            }
 
-    block = getBlockWithFreeRegion(size);
+            // Its allocations are freed by the calling thread
+            usedSize = 0;
+            Block_iterate(block, Block_addUsedSize, &usedSize);
+            threadStats.deallocated += usedSize;
 
-    memoryPtr = Block_allocateRegion(block, size);
+            Arena_releaseBlock(&arenas[i], block);
+            count++;
+        }
+    }
 
-    if (memoryPtr == NULL)
+    unlockHeap();
+
+    if (table != NULL)
     {
-        return 0;
+        Hooks_flush();
     }
 
-    return (void*)(memoryPtr) + sizeof(AllocMetadata_t);
+    return count;
 }
 
 /**
- * @brief realloc
- * @param pointer
+ * @brief halloc_malloc_near
+ * @param hint
  * @param size
  * @return
  *************************************************************************************************/
-void* realloc(void* pointer, size_t size)
+void* halloc_malloc_near(void* hint, size_t size)
 {
-    AllocMetadata_t* headerPtr     = (AllocMetadata_t*)(pointer - sizeof(AllocMetadata_t));
-    size_t           payloadLength = headerPtr->size - (sizeof(AllocMetadata_t)*2);
-    size_t           copyLength    = payloadLength;
-    void*            newMemoryPtr;
+    void* payload;
 
-    if (pointer == NULL)
+    if (hint == NULL || (payload = allocateNear(hint, size)) == NULL)
     {
         return malloc(size);
     }
 
-    if (payloadLength == size)
+    if (__atomic_load_n(&hookTable, __ATOMIC_RELAXED) != NULL)
     {
-        return pointer;
+        Hooks_allocated(payload, size);
     }
 
-    if (size < payloadLength)
+    return payload;
+}
+
+/**
+ * @brief halloc_lock_stats
+ * @param lockClass
+ * @param stats
+ * @return
+ *************************************************************************************************/
+int halloc_lock_stats(uint32_t lockClass, halloc_lock_stats_t* stats)
+{
+    LockProfile_t* profile;
+    uint32_t       i;
+
+    if (lockClass >= HALLOC_LOCK_CLASSES || stats == NULL)
     {
-        copyLength = size;
+        return -1;
     }
 
-    newMemoryPtr = malloc(size);
+    profile = &lockProfiles[lockClass];
 
-    if (newMemoryPtr == NULL)
+    stats->acquisitions = __atomic_load_n(&profile->acquisitions, __ATOMIC_RELAXED);
+    stats->contended    = __atomic_load_n(&profile->contended,    __ATOMIC_RELAXED);
+    stats->waitTotal    = __atomic_load_n(&profile->waitTotal,    __ATOMIC_RELAXED);
+    stats->waitMax      = __atomic_load_n(&profile->waitMax,      __ATOMIC_RELAXED);
+
+    for (i = 0; i < HALLOC_LOCK_HISTOGRAM; i++)
     {
-        return NULL;
+        stats->holdHistogram[i] = __atomic_load_n(&profile->holdHistogram[i], __ATOMIC_RELAXED);
     }
 
-    memcpy(newMemoryPtr, pointer, copyLength);
-    free (pointer);
-    return newMemoryPtr;
+    return 0;
 }
 
 /**
- * @brief calloc
- * @param num
- * @param size
+ * @brief halloc_background_start
  * @return
  *************************************************************************************************/
-void* calloc(size_t num, size_t size)
+int halloc_background_start()
 {
-    void*            memoryPtr;
-    AllocMetadata_t* header;
-    size_t           payloadLength;
+    uint32_t state = BACKGROUND_STOPPED;
 
-    if (size == 0)
+    if (!__atomic_compare_exchange_n(&backgroundState, &state, BACKGROUND_RUNNING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
     {
-        return NULL;
+        return (state == BACKGROUND_RUNNING) ? 0 : -1;
     }
 
-    memoryPtr     = malloc(num*size);
-
-    if (memoryPtr == NULL)
+    if (libhalloc_thread_start(Background_run, NULL) != 0)
     {
-        return NULL;
+        __atomic_store_n(&backgroundState, BACKGROUND_STOPPED, __ATOMIC_RELEASE);
+        return -1;
     }
 
-    header        = (AllocMetadata_t*)(memoryPtr - sizeof(AllocMetadata_t));
-    payloadLength = header->size - (sizeof(AllocMetadata_t)*2);
-
-    memset(memoryPtr, 0, payloadLength);
-
-    return memoryPtr;
+    return 0;
 }
 
 /**
- * @brief free
- * @param pointer
+ * @brief halloc_background_stop
  *************************************************************************************************/
-void free(void* pointer)
+void halloc_background_stop()
 {
-    AllocMetadata_t* allocatedRegion = (AllocMetadata_t*) (pointer - sizeof(AllocMetadata_t));
-    BlockHeader_t*   block           = NULL;
+    uint32_t state = BACKGROUND_RUNNING;
 
-    if (allocatedRegion->used == 0)
+    if (!__atomic_compare_exchange_n(&backgroundState, &state, BACKGROUND_STOPPING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+        state != BACKGROUND_STOPPING)
     {
         return;
     }
 
-    block = getBlockWithRegion(pointer);
-
-    if (block == NULL)
-    {
-        return; // Error
-    }
-
-    Block_deallocateRegion(block, allocatedRegion);
+    Background_wake();
 
-    // If the block does not contains user Allocations
-    // return it to the kernel
-    if (Block_haveUserAllocations(block) == 0)
+    while (__atomic_load_n(&backgroundState, __ATOMIC_ACQUIRE) == BACKGROUND_STOPPING)
     {
-        BlockList_removeBlockFromList(&blockList, block);
-        libhalloc_free(block, block->pages);
+        libhalloc_wait(&backgroundState, BACKGROUND_STOPPING, BACKGROUND_PERIOD);
     }
 }
 
@@ -971,7 +4101,30 @@ void mallocstats()
     BlockHeader_t*   block = NULL;
     uint32_t i;
 
-    for (block = blockList, i = 0; block != NULL; block = block->next, i++)
+    if (lockHeap() != 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < arenaCount; i++)
+    {
+        uint32_t usedSize = 0;
+
+        for (block = arenas[i].blockList; block != NULL; block = block->next)
+        {
+            usedSize += block->usedSize;
+        }
+
+        printf("Arena[%d] (NUMA node %d):\n", i, arenas[i].node);
+        printf("  Blocks                        : %d\n", arenas[i].blocks);
+        printf("  Size  (allocated from kernel) : %lu bytes\n", (unsigned long)arenas[i].size);
+        printf("  Used Size (allocated to app)  : %d bytes\n", usedSize);
+        printf("  Reserve (mappings ready)      : %d\n", arenas[i].reserveCount);
+        printf("  Blocks mapped from reserve    : %llu\n", (unsigned long long)arenas[i].reserveHits);
+        printf("  Blocks mapped synchronously   : %llu\n", (unsigned long long)arenas[i].syncMaps);
+    }
+
+    for (block = getFirstBlock(), i = 0; block != NULL; block = getNextBlock(block), i++)
     {
         uint32_t j;
         uint32_t freeRegionsCount       = 0;
@@ -1004,6 +4157,18 @@ void mallocstats()
         printf("  Pages (allocated from kernel) : %d\n", block->pages);
         printf("  Size  (allocated from kernel) : %d bytes\n", block->size);
         printf("  Used Size (allocated to app)  : %d bytes\n", block->usedSize);
+
+        if (block->tag != 0)
+        {
+            printf("  Tag                           : %#lx\n", (unsigned long)block->tag);
+        }
+
+        if (Block_isDense(block))
+        {
+            printf("  Dense (no boundary tags)      : %d byte granules\n", DENSE_GRANULE);
+            continue;
+        }
+
         printf("  Free statistics:\n");
         printf("    Free Regions Count : %d\n", freeRegionsCount);
         printf("    Largest Free Space : %d bytes\n", largestFreeRegionSize);
@@ -1021,4 +4186,387 @@ void mallocstats()
             printf("\n");
         }
     }
+
+    for (i = 0; i < CALL_SITES; i++)
+    {
+        CallSite_t*  site = &callSites[i];
+        const void*  key  = __atomic_load_n(&site->key, __ATOMIC_ACQUIRE);
+
+        if (key == NULL || key == CALL_SITE_CLAIMED)
+        {
+            continue;
+        }
+
+        if (site->name != NULL)
+        {
+            printf("CallSite[%s]:\n", site->name);
+        }
+        else
+        {
+            printf("CallSite[%p]:\n", key);
+        }
+
+        printf("  Allocations : %llu\n",       (unsigned long long)site->count);
+        printf("  Live Size   : %llu bytes\n", (unsigned long long)site->liveBytes);
+        printf("  Peak Size   : %llu bytes\n", (unsigned long long)site->peakBytes);
+    }
+
+    for (i = 0; i < ZERO_POOL_CLASSES; i++)
+    {
+        ZeroClass_t* zeroClass = &zeroClasses[i];
+
+        if (zeroClass->hits == 0 && zeroClass->misses == 0)
+        {
+            continue;
+        }
+
+        printf("ZeroPool[%lu bytes]:\n", (unsigned long)ZeroClass_size(i));
+        printf("  Ready  : %d\n",   zeroClass->count);
+        printf("  Hits   : %llu\n", (unsigned long long)zeroClass->hits);
+        printf("  Misses : %llu\n", (unsigned long long)zeroClass->misses);
+    }
+
+    for (i = 0; i < HALLOC_LOCK_CLASSES; i++)
+    {
+        static const char* names[HALLOC_LOCK_CLASSES] = { "heap", "arena", "block" };
+        halloc_lock_stats_t stats;
+        uint32_t            j;
+
+        halloc_lock_stats(i, &stats);
+
+        if (stats.acquisitions == 0)
+        {
+            continue;
+        }
+
+        printf("Lock[%s]:\n", names[i]);
+        printf("  Acquisitions : %llu\n",    (unsigned long long)stats.acquisitions);
+        printf("  Contended    : %llu\n",    (unsigned long long)stats.contended);
+        printf("  Wait Total   : %llu ns\n", (unsigned long long)stats.waitTotal);
+        printf("  Wait Max     : %llu ns\n", (unsigned long long)stats.waitMax);
+        printf("  Hold Times   :");
+
+        for (j = 0; j < HALLOC_LOCK_HISTOGRAM; j++)
+        {
+            if (stats.holdHistogram[j] != 0)
+            {
+                printf(" [%lluns] %llu", 1ull << j, (unsigned long long)stats.holdHistogram[j]);
+            }
+        }
+
+        printf("\n");
+    }
+
+    unlockHeap();
+}
+
+/**
+ * @brief mallinfo2
+ * @return
+ *************************************************************************************************/
+struct mallinfo2 mallinfo2()
+{
+    struct mallinfo2 info;
+    uint32_t         count = __atomic_load_n(&arenaCount, __ATOMIC_ACQUIRE);
+    uint32_t         i;
+    uint32_t         j;
+
+    memset(&info, 0, sizeof(info));
+
+    // The counters are read without locking: while other threads allocate they may be slightly
+    // out of step with each other
+    for (i = 0; i < count; i++)
+    {
+        Arena_t* arena = &arenas[i];
+
+        info.arena    += __atomic_load_n(&arena->size,         __ATOMIC_RELAXED);
+        info.uordblks += __atomic_load_n(&arena->usedSize,     __ATOMIC_RELAXED);
+        info.fordblks += __atomic_load_n(&arena->denseFree,    __ATOMIC_RELAXED);
+        info.hblks    += __atomic_load_n(&arena->reserveCount, __ATOMIC_RELAXED);
+
+        for (j = 0; j < FREE_BLOCKS_SETS; j++)
+        {
+            info.ordblks  += __atomic_load_n(&arena->freeCount[j], __ATOMIC_RELAXED);
+            info.fordblks += __atomic_load_n(&arena->freeSize[j],  __ATOMIC_RELAXED);
+        }
+    }
+
+    // Mappings held in reserve are not part of any arena yet
+    info.hblkhd = info.hblks * RESERVE_PAGES * PAGE_SIZE;
+
+    return info;
+}
+
+/**
+ * @brief malloc_info
+ * @param options
+ * @param stream
+ * @return
+ *************************************************************************************************/
+int malloc_info(int options, FILE* stream)
+{
+    uint32_t count      = __atomic_load_n(&arenaCount, __ATOMIC_ACQUIRE);
+    size_t   totalCount = 0;
+    size_t   totalFree  = 0;
+    size_t   totalSize  = 0;
+    size_t   totalPeak  = 0;
+    size_t   reserve    = 0;
+    uint32_t i;
+    uint32_t j;
+
+    if (options != 0 || stream == NULL)
+    {
+        return -1;
+    }
+
+    // Same layout as glibc, nothing is read under a lock so the stream is free to allocate
+    fprintf(stream, "<malloc version=\"1\">\n");
+
+    for (i = 0; i < count; i++)
+    {
+        Arena_t* arena     = &arenas[i];
+        size_t   freeCount = 0;
+        size_t   freeSize  = __atomic_load_n(&arena->denseFree, __ATOMIC_RELAXED);
+        size_t   size      = __atomic_load_n(&arena->size,      __ATOMIC_RELAXED);
+        size_t   peak      = __atomic_load_n(&arena->peakSize,  __ATOMIC_RELAXED);
+
+        fprintf(stream, "<heap nr=\"%u\">\n<sizes>\n", i);
+
+        for (j = 0; j < FREE_BLOCKS_SETS; j++)
+        {
+            size_t classCount = __atomic_load_n(&arena->freeCount[j], __ATOMIC_RELAXED);
+            size_t classSize  = __atomic_load_n(&arena->freeSize[j],  __ATOMIC_RELAXED);
+
+            if (classCount != 0)
+            {
+                fprintf(stream, "  <size from=\"%zu\" to=\"%zu\" total=\"%zu\" count=\"%zu\"/>\n",
+                        (j == 0) ? (size_t)MINIMUM_REGION_SIZE : (size_t)freeListLimits[j - 1] + 1, (size_t)freeListLimits[j], classSize, classCount);
+            }
+
+            freeCount += classCount;
+            freeSize  += classSize;
+        }
+
+        fprintf(stream, "</sizes>\n");
+        fprintf(stream, "<total type=\"fast\" count=\"0\" size=\"0\"/>\n");
+        fprintf(stream, "<total type=\"rest\" count=\"%zu\" size=\"%zu\"/>\n", freeCount, freeSize);
+        fprintf(stream, "<system type=\"current\" size=\"%zu\"/>\n", size);
+        fprintf(stream, "<system type=\"max\" size=\"%zu\"/>\n", peak);
+        fprintf(stream, "<aspace type=\"total\" size=\"%zu\"/>\n", size);
+        fprintf(stream, "<aspace type=\"mprotect\" size=\"%zu\"/>\n", size);
+        fprintf(stream, "</heap>\n");
+
+        totalCount += freeCount;
+        totalFree  += freeSize;
+        totalSize  += size;
+        totalPeak  += peak;
+        reserve    += __atomic_load_n(&arena->reserveCount, __ATOMIC_RELAXED);
+    }
+
+    fprintf(stream, "<total type=\"fast\" count=\"0\" size=\"0\"/>\n");
+    fprintf(stream, "<total type=\"rest\" count=\"%zu\" size=\"%zu\"/>\n", totalCount, totalFree);
+    fprintf(stream, "<total type=\"mmap\" count=\"%zu\" size=\"%zu\"/>\n", reserve, reserve * RESERVE_PAGES * PAGE_SIZE);
+    fprintf(stream, "<system type=\"current\" size=\"%zu\"/>\n", totalSize);
+    fprintf(stream, "<system type=\"max\" size=\"%zu\"/>\n", totalPeak);
+    fprintf(stream, "<aspace type=\"total\" size=\"%zu\"/>\n", totalSize);
+    fprintf(stream, "<aspace type=\"mprotect\" size=\"%zu\"/>\n", totalSize);
+    fprintf(stream, "</malloc>\n");
+
+    return 0;
+}
+
+/**
+ * @brief halloc_stats_prometheus
+ * @param buffer
+ * @param size
+ * @return
+ *************************************************************************************************/
+size_t halloc_stats_prometheus(char* buffer, size_t size)
+{
+    static const char* lockNames[HALLOC_LOCK_CLASSES] = { "heap", "arena", "block" };
+
+    TextBuffer_t text  = { buffer, size, 0 };
+    uint32_t     count = __atomic_load_n(&arenaCount, __ATOMIC_ACQUIRE);
+    uint32_t     i;
+    uint32_t     j;
+
+    if (size > 0)
+    {
+        buffer[0] = '\0';
+    }
+
+    // Every counter is read without a lock, allocating threads are never held up
+    TextBuffer_arenaFamily(&text, "arena_mapped_bytes",      "gauge",   "Bytes of the heap blocks mapped from the system.",         ARENA_COUNTER(size));
+    TextBuffer_arenaFamily(&text, "arena_mapped_peak_bytes", "gauge",   "Highest number of bytes mapped for heap blocks.",          ARENA_COUNTER(peakSize));
+    TextBuffer_arenaFamily(&text, "arena_used_bytes",        "gauge",   "Bytes allocated, boundary tags and block headers included.", ARENA_COUNTER(usedSize));
+    TextBuffer_arenaFamily(&text, "arena_blocks",            "gauge",   "Heap blocks of the arena.",                                ARENA_COUNTER(blocks));
+    TextBuffer_arenaFamily(&text, "arena_dense_free_bytes",  "gauge",   "Bytes of the free granules of dense blocks.",              ARENA_COUNTER(denseFree));
+    TextBuffer_arenaFamily(&text, "arena_reserve_mappings",  "gauge",   "Mappings kept in reserve for new heap blocks.",            ARENA_COUNTER(reserveCount));
+    TextBuffer_arenaFamily(&text, "arena_reserve_maps_total","counter", "Heap blocks which took a mapping from the reserve.",        ARENA_COUNTER(reserveHits));
+    TextBuffer_arenaFamily(&text, "arena_sync_maps_total",   "counter", "Heap blocks for which the allocating thread mapped pages.", ARENA_COUNTER(syncMaps));
+
+    TextBuffer_family(&text, "arena_free_regions", "gauge", "Free regions in the free lists, by largest region size of the class.");
+
+    for (i = 0; i < count; i++)
+    {
+        for (j = 0; j < FREE_BLOCKS_SETS; j++)
+        {
+            TextBuffer_classSample(&text, "arena_free_regions", i, j, __atomic_load_n(&arenas[i].freeCount[j], __ATOMIC_RELAXED));
+        }
+    }
+
+    TextBuffer_family(&text, "arena_free_bytes", "gauge", "Bytes of the free regions in the free lists, by largest region size of the class.");
+
+    for (i = 0; i < count; i++)
+    {
+        for (j = 0; j < FREE_BLOCKS_SETS; j++)
+        {
+            TextBuffer_classSample(&text, "arena_free_bytes", i, j, __atomic_load_n(&arenas[i].freeSize[j], __ATOMIC_RELAXED));
+        }
+    }
+
+    TextBuffer_family(&text, "zero_pool_hits_total", "counter", "Large calloc calls served by the pre-zeroed pool.");
+
+    for (i = 0; i < ZERO_POOL_CLASSES; i++)
+    {
+        TextBuffer_append(&text, "halloc_zero_pool_hits_total{size=\"%lu\"} %llu\n", (unsigned long)ZeroClass_size(i),
+                          (unsigned long long)__atomic_load_n(&zeroClasses[i].hits, __ATOMIC_RELAXED));
+    }
+
+    TextBuffer_family(&text, "zero_pool_misses_total", "counter", "Large calloc calls which found their class of the pre-zeroed pool empty.");
+
+    for (i = 0; i < ZERO_POOL_CLASSES; i++)
+    {
+        TextBuffer_append(&text, "halloc_zero_pool_misses_total{size=\"%lu\"} %llu\n", (unsigned long)ZeroClass_size(i),
+                          (unsigned long long)__atomic_load_n(&zeroClasses[i].misses, __ATOMIC_RELAXED));
+    }
+
+    TextBuffer_family(&text, "lock_acquisitions_total", "counter", "Acquisitions of the locks of a class.");
+
+    for (i = 0; i < HALLOC_LOCK_CLASSES; i++)
+    {
+        TextBuffer_append(&text, "halloc_lock_acquisitions_total{lock=\"%s\"} %llu\n", lockNames[i],
+                          (unsigned long long)__atomic_load_n(&lockProfiles[i].acquisitions, __ATOMIC_RELAXED));
+    }
+
+    TextBuffer_family(&text, "lock_contended_total", "counter", "Acquisitions which had to wait for another thread.");
+
+    for (i = 0; i < HALLOC_LOCK_CLASSES; i++)
+    {
+        TextBuffer_append(&text, "halloc_lock_contended_total{lock=\"%s\"} %llu\n", lockNames[i],
+                          (unsigned long long)__atomic_load_n(&lockProfiles[i].contended, __ATOMIC_RELAXED));
+    }
+
+    TextBuffer_family(&text, "lock_wait_seconds_total", "counter", "Time spent waiting for the locks of a class.");
+
+    for (i = 0; i < HALLOC_LOCK_CLASSES; i++)
+    {
+        TextBuffer_append(&text, "halloc_lock_wait_seconds_total{lock=\"%s\"} ", lockNames[i]);
+        TextBuffer_seconds(&text, __atomic_load_n(&lockProfiles[i].waitTotal, __ATOMIC_RELAXED));
+        TextBuffer_append(&text, "\n");
+    }
+
+    // The hold times are only bucketed, so the histograms have no _sum
+    TextBuffer_family(&text, "lock_hold_seconds", "histogram", "Sampled hold times of the locks of a class.");
+
+    for (i = 0; i < HALLOC_LOCK_CLASSES; i++)
+    {
+        uint64_t cumulative = 0;
+
+        // The last bucket also holds the longer holds clamped into it, it only has an infinite bound
+        for (j = 0; j < HALLOC_LOCK_HISTOGRAM - 1; j++)
+        {
+            cumulative += __atomic_load_n(&lockProfiles[i].holdHistogram[j], __ATOMIC_RELAXED);
+
+            TextBuffer_append(&text, "halloc_lock_hold_seconds_bucket{lock=\"%s\",le=\"", lockNames[i]);
+            TextBuffer_seconds(&text, (2ull << j) - 1);
+            TextBuffer_append(&text, "\"} %llu\n", (unsigned long long)cumulative);
+        }
+
+        cumulative += __atomic_load_n(&lockProfiles[i].holdHistogram[HALLOC_LOCK_HISTOGRAM - 1], __ATOMIC_RELAXED);
+
+        TextBuffer_append(&text, "halloc_lock_hold_seconds_bucket{lock=\"%s\",le=\"+Inf\"} %llu\n", lockNames[i], (unsigned long long)cumulative);
+        TextBuffer_append(&text, "halloc_lock_hold_seconds_count{lock=\"%s\"} %llu\n", lockNames[i], (unsigned long long)cumulative);
+    }
+
+    return text.length;
+}
+
+/**
+ * @brief halloc_history_interval
+ * @param interval
+ *************************************************************************************************/
+void halloc_history_interval(uint32_t interval)
+{
+    __atomic_store_n(&historyInterval, (uint64_t)interval * 1000000ull, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief halloc_history_read
+ * @param samples
+ * @param count
+ * @return
+ *************************************************************************************************/
+size_t halloc_history_read(halloc_history_sample_t* samples, size_t count)
+{
+    uint64_t written = __atomic_load_n(&historyWritten, __ATOMIC_ACQUIRE);
+    uint64_t first;
+    uint64_t index;
+    size_t   read = 0;
+
+    if (count > HALLOC_HISTORY_SAMPLES)
+    {
+        count = HALLOC_HISTORY_SAMPLES;
+    }
+
+    first = (written > count) ? written - count : 0;
+
+    for (index = first; index < written; index++)
+    {
+        HistorySlot_t* slot = &historySlots[index % HALLOC_HISTORY_SAMPLES];
+
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != 2 * index + 2)
+        {
+            continue;
+        }
+
+        samples[read] = slot->sample;
+
+        // Skip the sample if the worker overwrote it while it was copied
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == 2 * index + 2)
+        {
+            read++;
+        }
+    }
+
+    return read;
+}
+
+/**
+ * @brief halloc_set_hooks
+ * @param hooks
+ *************************************************************************************************/
+void halloc_set_hooks(const halloc_hooks_t* hooks)
+{
+    __atomic_store_n(&hookTable, hooks, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief halloc_thread_stats
+ * @return
+ *************************************************************************************************/
+const halloc_thread_stats_t* halloc_thread_stats()
+{
+    return &threadStats;
+}
+
+/**
+ * @brief halloc_set_streams
+ * @param streams
+ *************************************************************************************************/
+void halloc_set_streams(uint32_t streams)
+{
+    __atomic_store_n(&streamCount, (streams < HALLOC_MAX_STREAMS) ? streams : HALLOC_MAX_STREAMS, __ATOMIC_RELAXED);
 }
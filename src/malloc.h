@@ -1,6 +1,7 @@
 #ifndef MALLOC_H
 #define MALLOC_H
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
 
@@ -15,6 +16,432 @@ extern void  free(void *);              ///< The standard function.
 
 extern void  mallocstats();
 
+#ifndef _MALLOC_H
+
+/** Heap statistics returned by mallinfo2, laid out as in the <malloc.h>
+* of glibc, which may be included before this header instead.
+*/
+struct mallinfo2
+{
+    size_t arena;       ///< Bytes of the heap blocks of the arenas.
+    size_t ordblks;     ///< Free regions in the free lists.
+    size_t smblks;      ///< Always 0, there are no fast bins.
+    size_t hblks;       ///< Mappings kept in reserve for new heap blocks.
+    size_t hblkhd;      ///< Bytes of those mappings.
+    size_t usmblks;     ///< Always 0, as in glibc.
+    size_t fsmblks;     ///< Always 0, there are no fast bins.
+    size_t uordblks;    ///< Bytes allocated, boundary tags and block headers included.
+    size_t fordblks;    ///< Bytes of the free regions and of the free granules of dense blocks.
+    size_t keepcost;    ///< Always 0, blocks are given back as soon as they are empty.
+};
+
+#endif
+
+/** The glibc extension. The figures come from counters the allocator
+* keeps up to date, so the call does not walk the heap nor take a lock.
+*/
+extern struct mallinfo2 mallinfo2();
+
+/** The glibc extension: writes the free lists of each arena, the bytes
+* mapped and the mappings held in reserve to stream as XML, in the format
+* of glibc.
+*
+* \return 0 on success, -1 if options is not 0.
+*/
+extern int   malloc_info(int options, FILE* stream);
+
+/** Writes the statistics of the heap to buffer in the Prometheus text
+* format: the counters of each arena, the hits of the pre-zeroed pool and
+* the contention profile of the locks. The counters are read without
+* taking any lock and nothing is allocated. The text is terminated and
+* cut if it does not fit.
+*
+* \return The length of the whole text, size or more if it was cut.
+*/
+extern size_t halloc_stats_prometheus(char* buffer, size_t size);
+
+#define HALLOC_EXPORT_FILE      0   ///< The exporter rewrites a file periodically.
+#define HALLOC_EXPORT_SOCKET    1   ///< The exporter answers scrapes on a UNIX socket.
+
+/** Starts a thread exporting halloc_stats_prometheus. With
+* HALLOC_EXPORT_SOCKET it listens on a UNIX socket at path and answers
+* each connection with an HTTP response holding fresh statistics. With
+* HALLOC_EXPORT_FILE it replaces the file at path every period
+* milliseconds (1000 if 0), e.g. for the textfile collector of
+* node_exporter. The exporter never allocates from the heap.
+*
+* \return 0 if the exporter runs, -1 if it could not be started or one
+* already runs.
+*/
+extern int   halloc_export_start(const char* path, int mode, uint32_t period);
+
+/** Stops the exporter and removes its socket. It returns once the
+* exporter is done.
+*/
+extern void  halloc_export_stop();
+
+#define HALLOC_HISTORY_SAMPLES  1024    ///< Samples kept by the statistics history.
+
+/** A sample of the statistics history.
+*/
+typedef struct halloc_history_sample_s
+{
+    uint64_t time;          ///< libhalloc_clock() when the sample was taken, in nanoseconds.
+    uint64_t mapped;        ///< Bytes of the heap blocks mapped from the system.
+    uint64_t active;        ///< Bytes allocated, boundary tags and block headers included.
+    uint32_t fragmentation; ///< Per mille of the mapped bytes which are not allocated.
+    uint32_t blocks;        ///< Heap blocks.
+    uint32_t mapsPerSecond; ///< Calls mapping pages per second since the previous sample.
+
+} halloc_history_sample_t;
+
+/** Sets how often, in milliseconds, the background worker records a
+* sample of the heap statistics into a ring of HALLOC_HISTORY_SAMPLES
+* samples, which keeps the last ones. 0, the default, stops recording.
+* Samples are only taken while the worker runs.
+*/
+extern void  halloc_history_interval(uint32_t interval);
+
+/** Copies the count most recent samples of the history to samples, the
+* oldest first. It neither locks nor allocates, so it can be called from
+* a signal handler.
+*
+* \return The number of samples copied.
+*/
+extern size_t halloc_history_read(halloc_history_sample_t* samples, size_t count);
+
+/** Writes the history to the file descriptor fd as text, one sample per
+* line, with the age of each sample in milliseconds. Only write(2) is
+* used and nothing is allocated, so it can be called from the handler of
+* a fatal signal.
+*
+* \return 0 if the history was written, -1 on a write error or while
+* another dump runs.
+*/
+extern int   halloc_history_dump(int fd);
+
+/** Functions called on the allocation events, any of them may be NULL.
+* They run on the thread causing the event, outside the locks of the
+* allocator, and may allocate: the allocations made by a hook are not
+* reported. Frees and block unmappings are reported once they are done.
+*/
+typedef struct halloc_hooks_s
+{
+    void (*onAlloc)(void* ptr, size_t size, void* ctx);                 ///< malloc, calloc and the halloc_malloc_* functions.
+    void (*onFree)(void* ptr, void* ctx);                               ///< free and each allocation of halloc_free_batch or halloc_free_tag.
+    void (*onRealloc)(void* old, void* ptr, size_t size, void* ctx);    ///< realloc of an allocation, old may be ptr.
+    void (*onBlockMap)(void* block, size_t size, void* ctx);            ///< A heap block was added to an arena.
+    void (*onBlockUnmap)(void* block, size_t size, void* ctx);          ///< A heap block was released, e.g. by halloc_free_tag.
+    void* ctx;                                                          ///< Given to every hook.
+
+} halloc_hooks_t;
+
+/** Sets the hooks called on allocation events, or removes them if hooks
+* is NULL. The table is used in place: it must stay valid and unchanged
+* while it is set. Without hooks each event costs a single test.
+*/
+extern void  halloc_set_hooks(const halloc_hooks_t* hooks);
+
+/** Bytes allocated and freed by a thread since it started, counted in
+* usable sizes: the payload of the regions, padding included. A region
+* freed by another thread than the one which allocated it is counted by
+* the one freeing it.
+*/
+typedef struct halloc_thread_stats_s
+{
+    uint64_t allocated;     ///< Bytes allocated by the thread.
+    uint64_t deallocated;   ///< Bytes freed by the thread.
+
+} halloc_thread_stats_t;
+
+/** Gets the counters of the calling thread. The counters are only written
+* by that thread, without atomics, and stay at the same address for its
+* lifetime, so the pointer can be cached and read at any time without a
+* call. halloc_free_tag counts the allocations of the blocks it releases
+* as freed by the calling thread.
+*
+* \return The counters of the calling thread.
+*/
+extern const halloc_thread_stats_t* halloc_thread_stats();
+
+#define HALLOC_STRINGIFY_(x)    #x
+#define HALLOC_STRINGIFY(x)     HALLOC_STRINGIFY_(x)
+
+/** Call site tag of the line where it is used, e.g. "src/main.c:42".
+*/
+#define HALLOC_SITE             (__FILE__ ":" HALLOC_STRINGIFY(__LINE__))
+
+/** Same as malloc, but the allocation is accounted to a call site: its
+* allocation count, live bytes and peak live bytes are shown by
+* mallocstats. The site is a tag, usually HALLOC_SITE, compared by
+* address; if it is NULL the return address of the caller is used. The
+* allocation is released by free as usual; realloc gives back an
+* allocation which is no longer accounted.
+*
+* \return NULL if the memory was not allocated.
+*/
+extern void* halloc_malloc_site(size_t size, const char* site);
+
+/** Allocates size bytes accounted to the line where it is used.
+*/
+#define halloc_malloc_here(size)    halloc_malloc_site((size), HALLOC_SITE)
+
+#define HALLOC_CALL_SITES       1024    ///< Entries of the call site table, the last one gathers the sites which did not fit.
+
+/** Counters of a call site of halloc_malloc_site.
+*/
+typedef struct halloc_site_stats_s
+{
+    const void* key;        ///< Call site tag or return address.
+    const char* name;       ///< Call site tag, NULL if keyed by return address.
+    uint64_t    count;      ///< Allocations made.
+    uint64_t    liveBytes;  ///< Bytes requested and not freed yet.
+    uint64_t    peakBytes;  ///< Highest liveBytes seen.
+
+} halloc_site_stats_t;
+
+/** Copies the counters of the entry index (0 to HALLOC_CALL_SITES - 1) of
+* the call site table into stats, the ones shown by mallocstats.
+*
+* \return 0 if the entry holds a call site, -1 if it is free.
+*/
+extern int   halloc_site_stats(uint32_t index, halloc_site_stats_t* stats);
+
+#define HALLOC_REGION_FREE      0   ///< Region is free.
+#define HALLOC_REGION_USED      1   ///< Region is allocated.
+#define HALLOC_REGION_INTERNAL  2   ///< Region is used by the allocator itself.
+
+/** A region of the heap, as reported by halloc_iterate.
+*/
+typedef struct halloc_region_s
+{
+    void*  block;       ///< Start of the heap block holding the region.
+    size_t blockSize;   ///< Size of the heap block in bytes.
+    void*  address;     ///< Payload address, as returned by malloc.
+    size_t size;        ///< Payload size in bytes, padding included.
+    int    state;       ///< One of the HALLOC_REGION_* values.
+    uintptr_t tag;      ///< Tag the heap block is dedicated to, 0 if untagged.
+    uint32_t node;      ///< NUMA node of the arena holding the heap block.
+    size_t overhead;    ///< Bytes of boundary tags around the payload, 0 in dense blocks.
+
+} halloc_region_t;
+
+/** Called by halloc_iterate for each region. It must not allocate or free
+* memory from the heap.
+*
+* \return 0 to continue the walk. Anything else stops it.
+*/
+typedef int (*halloc_iterate_callback_t)(const halloc_region_t* region, void* ctx);
+
+/** Walks every region of every heap block, in address order inside each
+* block, holding the heap lock and without allocating. ctx is given
+* untouched to the callback.
+*
+* \return 0 if every region was visited, otherwise the value returned by
+* the callback which stopped the walk (-1 if a corrupted boundary tag was
+* found).
+*/
+extern int   halloc_iterate(halloc_iterate_callback_t callback, void* ctx);
+
+/** Same as malloc, but the allocation is placed in heap blocks dedicated
+* to tag, which is any non-zero value (e.g. the address of the object
+* owning the allocations). Tagged allocations can be freed one by one or
+* all at once by halloc_free_tag. A zero tag gives an untagged allocation.
+*
+* \return NULL if the memory was not allocated.
+*/
+extern void* halloc_malloc_tagged(uintptr_t tag, size_t size);
+
+/** Frees every allocation made with tag at once, giving the heap blocks
+* dedicated to it back to the system without visiting the allocations.
+*
+* \return The number of heap blocks released.
+*/
+extern size_t halloc_free_tag(uintptr_t tag);
+
+/** Same as malloc, but the allocation is placed as close as possible to
+* hint, an allocation of the heap (e.g. the parent of a tree node): in the
+* free region of the heap block holding hint nearest to it. If that block
+* has no room, or hint does not come from the heap, it falls back to
+* malloc.
+*
+* \return NULL if the memory was not allocated.
+*/
+extern void* halloc_malloc_near(void* hint, size_t size);
+
+#define HALLOC_MAX_STREAMS      16  ///< Most allocation streams of halloc_set_streams.
+
+/** Makes malloc segregate its allocations by call site: the return
+* address of the caller is hashed into one of streams allocation streams,
+* and each allocation is placed as close as possible to the previous one
+* of its stream in the calling thread, as by halloc_malloc_near. The
+* objects of a site, which tend to be used and freed together, are then
+* clustered instead of scattered over the heap. 0, the default, turns it
+* off; streams above HALLOC_MAX_STREAMS are clamped.
+*/
+extern void  halloc_set_streams(uint32_t streams);
+
+/** Frees a chain of allocations linked through their first word (each
+* allocation holds the pointer to the next one, the last holds NULL),
+* taking the heap lock only once for the whole chain.
+*/
+extern void  halloc_free_batch(void* chain);
+
+#define HALLOC_LOCK_HEAP        0   ///< The global heap lock.
+#define HALLOC_LOCK_ARENA       1   ///< The locks of the arenas.
+#define HALLOC_LOCK_BLOCK       2   ///< The locks of the heap blocks.
+#define HALLOC_LOCK_CLASSES     3   ///< Number of lock classes profiled.
+#define HALLOC_LOCK_HISTOGRAM   32  ///< Buckets of the hold time histograms.
+
+/** Contention profile of a class of locks, as reported by halloc_lock_stats.
+* Times are in nanoseconds. Hold times are sampled: every contended
+* acquisition and one in 64 of the others.
+*/
+typedef struct halloc_lock_stats_s
+{
+    uint64_t acquisitions;  ///< Times a lock of the class was acquired.
+    uint64_t contended;     ///< Acquisitions which had to wait for another thread.
+    uint64_t waitTotal;     ///< Total time spent waiting for the locks.
+    uint64_t waitMax;       ///< Longest wait for a lock.
+    uint64_t holdHistogram[HALLOC_LOCK_HISTOGRAM]; ///< Bucket i counts holds of 2^i to 2^(i+1) - 1 ns, the last one any longer hold.
+
+} halloc_lock_stats_t;
+
+/** Copies the contention profile of a class of locks, one of the
+* HALLOC_LOCK_* values, into stats. It is also shown by mallocstats.
+*
+* \return 0 if the profile was copied, -1 if the class is unknown.
+*/
+extern int   halloc_lock_stats(uint32_t lockClass, halloc_lock_stats_t* stats);
+
+/** Starts the background worker of the allocator. While it runs, it keeps
+* regions of 16 KiB to 2 MiB zeroed in advance for the large calloc calls:
+* each calloc finding none ready asks for more of its size class, and the
+* large allocations freed are zeroed by the worker rather than the caller
+* of the next calloc.
+*
+* \return 0 if the worker runs, -1 if it could not be started.
+*/
+extern int   halloc_background_start();
+
+/** Stops the background worker and frees the regions it kept ready. It
+* returns once the worker is done.
+*/
+extern void  halloc_background_stop();
+
+/** Marks the calling thread as inside a critical region of a lock-free
+* data structure. Objects retired while any thread is inside a region
+* started before the retirement will not be freed. Regions may nest.
+*/
+extern void  halloc_epoch_enter();
+
+/** Marks the end of the critical region started by halloc_epoch_enter.
+*/
+extern void  halloc_epoch_leave();
+
+/** Retires an allocation unlinked from a lock-free data structure. It is
+* freed, together with the other objects retired by this thread, once
+* every thread has left the critical regions that could still see it.
+* The first word of the allocation is used to chain it, so the object
+* must not be written after being retired.
+*/
+extern void  halloc_retire(void* ptr);
+
+/** Tries to advance the global epoch and frees the calling thread's
+* retired objects which became safe to free.
+*
+* \return The number of objects freed.
+*/
+extern size_t halloc_epoch_collect();
+
+/** Allocates a short lived frame, e.g. a C++20 coroutine frame. Frames up
+* to 1 KiB are recycled in per thread stacks of frames of similar size,
+* bigger ones come straight from the heap. Stacks overflowing or running
+* empty hand batches of frames over to other threads through a shared
+* transfer cache instead of going through the heap.
+*
+* \return NULL if the frame could not be allocated.
+*/
+extern void* halloc_frame_alloc(size_t size);
+
+/** Frees a frame returned by halloc_frame_alloc. The size must be the same
+* size given to halloc_frame_alloc.
+*/
+extern void  halloc_frame_free(void* ptr, size_t size);
+
+/** Starts a new scavenging interval, meant to be called periodically, e.g.
+* from a timer. Frames a thread kept cached during the whole previous
+* interval without using them are given back to the heap: right away for
+* threads which were idle during it, at their next frame allocation or
+* free for the others.
+*
+* \return The number of bytes given back to the heap from idle threads.
+*/
+extern size_t halloc_frame_scavenge();
+
+/** \return The number of bytes given back to the heap by scavenging since
+* the process started, including those released by the threads themselves.
+*/
+extern size_t halloc_frame_scavenged();
+
+/** Allocates a ring buffer of size bytes whose pages are mapped twice, back
+* to back: the byte at ring + size + i is the byte at ring + i. Producers
+* and consumers can then copy or parse data crossing the end of the ring
+* as one contiguous range. The size must be a multiple of the page size.
+* The ring buffer does not come from the heap: it is released with
+* halloc_ring_free only.
+*
+* \return NULL if the ring buffer was not allocated.
+*/
+extern void* halloc_ring_alloc(size_t size);
+
+/** Frees a ring buffer allocated by halloc_ring_alloc. The size must be the
+* same size given to halloc_ring_alloc.
+*
+* \return 0 if the ring buffer was successfully freed.
+*/
+extern int   halloc_ring_free(void* ring, size_t size);
+
+/** A buffer which grows in place inside an address range reserved up
+* front: its pages are committed as it grows and decommitted as it
+* shrinks, so it is never moved nor copied.
+*/
+typedef struct halloc_vbuf_s
+{
+    char*  data;        ///< Start of the buffer, page aligned, never moves.
+    size_t size;        ///< Bytes in use.
+    size_t committed;   ///< Bytes backed by readable and writable pages.
+    size_t reserved;    ///< Bytes reserved, the most the buffer can grow to.
+
+} halloc_vbuf_t;
+
+/** Reserves max_bytes of address space for a growable buffer. The buffer
+* does not come from the heap: it is released with halloc_vbuf_destroy.
+*
+* \return NULL if the buffer was not created.
+*/
+extern halloc_vbuf_t* halloc_vbuf_create(size_t max_bytes);
+
+/** Changes the size of a growable buffer, committing the pages it grows
+* into or decommitting the whole pages it no longer uses.
+*
+* \return 0 if the buffer was resized.
+*/
+extern int   halloc_vbuf_resize(halloc_vbuf_t* vbuf, size_t size);
+
+/** Appends length bytes copied from data to a growable buffer.
+*
+* \return NULL if the buffer would grow past its reserved size.
+* \return A pointer to the appended bytes inside the buffer.
+*/
+extern void* halloc_vbuf_append(halloc_vbuf_t* vbuf, const void* data, size_t length);
+
+/** Releases a growable buffer and its whole reserved range.
+*
+* \return 0 if the buffer was successfully freed.
+*/
+extern int   halloc_vbuf_destroy(halloc_vbuf_t* vbuf);
+
 /** This function is supposed to lock the memory data structures. It
 * could be as simple as disabling interrupts or acquiring a spinlock.
 * It's up to you to decide.
@@ -32,6 +459,20 @@ extern int libhalloc_lock();
 */
 extern int libhalloc_unlock();
 
+/** Same as libhalloc_lock, but it must not wait if the memory data
+* structures are locked by another thread.
+*
+* \return 0 if the lock was acquired. Anything else means it is busy.
+*/
+extern int libhalloc_trylock();
+
+/** This is the hook into the local system which reads a monotonic clock.
+* It is only called to profile locks which are contended or sampled.
+*
+* \return The current time in nanoseconds.
+*/
+extern uint64_t libhalloc_clock();
+
 /** This is the hook into the local system which allocates pages. It
 * accepts an integer parameter which is the number of pages
 * required. The page size was set up in the liballoc_init function.
@@ -51,6 +492,62 @@ extern void* libhalloc_alloc(size_t pages);
 */
 extern int libhalloc_free(void*ptr, size_t pages);
 
+/** This is the hook into the local system which notifies the allocator
+* that the calling thread is terminating. The callback will be called
+* with arg when the calling thread exits.
+*
+* \return 0 if the callback was registered. Anything else is failure.
+*/
+extern int libhalloc_thread_exit(void (*callback)(void*), void* arg);
+
+/** This is the hook into the local system which starts a background
+* thread of the allocator running routine(arg). Nobody waits for it to
+* finish.
+*
+* \return 0 if the thread was started. Anything else is failure.
+*/
+extern int libhalloc_thread_start(void* (*routine)(void*), void* arg);
+
+/** This is the hook into the local system which puts the calling thread
+* to sleep while the word at address holds value, for timeout nanoseconds
+* at most, until libhalloc_wake is called on the same address.
+*
+* \return 0 if the thread was woken up. Anything else means it timed out
+* or did not sleep.
+*/
+extern int libhalloc_wait(uint32_t* address, uint32_t value, uint64_t timeout);
+
+/** This is the hook into the local system which wakes up every thread
+* sleeping in libhalloc_wait on address.
+*
+* \return 0 if the threads were woken up.
+*/
+extern int libhalloc_wake(uint32_t* address);
+
+/** This is the hook into the local system which tells how many NUMA nodes
+* the allocator should keep arenas for. Returning 1 keeps a single arena.
+*
+* \return The number of NUMA nodes.
+*/
+extern uint32_t libhalloc_numa_nodes();
+
+/** This is the hook into the local system which tells on which NUMA node
+* the calling thread is running. The thread allocates from the arena of
+* that node.
+*
+* \return The NUMA node of the calling thread.
+*/
+extern uint32_t libhalloc_numa_node();
+
+/** Same as libhalloc_alloc, but the pages should be placed on the given
+* NUMA node. It is only called when libhalloc_numa_nodes returned more
+* than 1.
+*
+* \return NULL if the pages were not allocated.
+* \return A pointer to the allocated memory.
+*/
+extern void* libhalloc_alloc_node(size_t pages, uint32_t node);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,341 @@
+/* Multi-threaded scalability benchmark: halloc and glibc malloc running the
+ * same workloads with 1 up to the number of cores threads.
+ *
+ *   churn      each thread allocates and frees in a working set of its own
+ *   xfree      each thread hands its allocations to the next thread, which
+ *              frees them (producer-consumer, every free is cross-thread)
+ *   pool       all threads replace random entries of one shared pool
+ *
+ * Each run is forked so its peak RSS can be measured on its own.
+ *
+ *   mt_bench [max threads] [operations per thread]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "malloc.h"
+
+#define MAX_THREADS         256
+#define DEFAULT_OPERATIONS  1000000
+#define WORKING_SET         256         // Allocations each thread keeps alive in churn
+#define POOL_SIZE           4096        // Allocations shared by all threads in pool
+#define RING_SIZE           256         // Allocations in flight between two threads in xfree
+#define MAX_SIZE            512         // Allocations are 8 to MAX_SIZE bytes
+
+extern void* __libc_malloc(size_t size);
+extern void  __libc_free(void* ptr);
+
+typedef struct Allocator_s
+{
+    const char* name;
+    void* (*allocate)(size_t);
+    void  (*release)(void*);
+
+} Allocator_t;
+
+typedef struct Ring_s
+{
+    void*             slots[RING_SIZE];
+    volatile uint64_t head;             // Written by the producer only
+    volatile uint64_t tail;             // Written by the consumer only
+
+} __attribute__((aligned(64))) Ring_t;
+
+typedef struct Run_s
+{
+    const Allocator_t* allocator;
+    void             (*workload)(struct Run_s*, uint32_t);
+    uint32_t           threads;
+    uint64_t           operations;
+    pthread_barrier_t  start;
+    uint32_t           finished;
+
+} Run_t;
+
+typedef struct Worker_s
+{
+    Run_t*   run;
+    uint32_t id;
+
+} Worker_t;
+
+static Ring_t rings[MAX_THREADS];
+static void*  pool[POOL_SIZE];
+
+static void* hallocAllocate(size_t size) { return malloc(size); }
+static void  hallocRelease(void* ptr)    { free(ptr); }
+
+static const Allocator_t allocators[] =
+{
+    { "halloc", hallocAllocate, hallocRelease },
+    { "glibc",  __libc_malloc,  __libc_free   },
+};
+
+static double elapsed(struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static size_t randomSize(unsigned int* seed)
+{
+    return 8 + rand_r(seed) % (MAX_SIZE - 8);
+}
+
+static void churn(Run_t* run, uint32_t id)
+{
+    void*        live[WORKING_SET] = { NULL };
+    unsigned int seed = id + 1;
+    uint64_t     i;
+
+    for (i = 0; i < run->operations; i++)
+    {
+        uint32_t slot = rand_r(&seed) % WORKING_SET;
+
+        run->allocator->release(live[slot]);
+        live[slot] = run->allocator->allocate(randomSize(&seed));
+        *(char*)live[slot] = (char)i;
+    }
+
+    for (i = 0; i < WORKING_SET; i++)
+    {
+        run->allocator->release(live[i]);
+    }
+}
+
+static void drain(Run_t* run, Ring_t* ring)
+{
+    while (ring->tail != ring->head)
+    {
+        void* ptr = ring->slots[ring->tail % RING_SIZE];
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        run->allocator->release(ptr);
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void xfree(Run_t* run, uint32_t id)
+{
+    Ring_t*      own  = &rings[id];
+    Ring_t*      next = &rings[(id + 1) % run->threads];
+    unsigned int seed = id + 1;
+    uint64_t     i;
+
+    for (i = 0; i < run->operations; i++)
+    {
+        void* ptr = run->allocator->allocate(randomSize(&seed));
+
+        *(char*)ptr = (char)i;
+
+        // Freeing what the previous thread sent keeps the ring of this one moving
+        while (next->head - __atomic_load_n(&next->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+        {
+            drain(run, own);
+            sched_yield(); // The consumer may share the core
+        }
+
+        next->slots[next->head % RING_SIZE] = ptr;
+        __atomic_store_n(&next->head, next->head + 1, __ATOMIC_RELEASE);
+    }
+
+    __atomic_add_fetch(&run->finished, 1, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&run->finished, __ATOMIC_ACQUIRE) < run->threads)
+    {
+        drain(run, own);
+        sched_yield();
+    }
+
+    drain(run, own);
+}
+
+static void sharedPool(Run_t* run, uint32_t id)
+{
+    unsigned int seed = id + 1;
+    uint64_t     i;
+
+    for (i = 0; i < run->operations; i++)
+    {
+        void* ptr = run->allocator->allocate(randomSize(&seed));
+
+        *(char*)ptr = (char)i;
+
+        run->allocator->release(__atomic_exchange_n(&pool[rand_r(&seed) % POOL_SIZE], ptr, __ATOMIC_ACQ_REL));
+    }
+}
+
+static void* worker(void* arg)
+{
+    Worker_t* worker = (Worker_t*) arg;
+
+    pthread_barrier_wait(&worker->run->start);
+
+    worker->run->workload(worker->run, worker->id);
+
+    return NULL;
+}
+
+/* Runs a workload in a child process.
+ *
+ * Returns the operations per second of each thread, or a negative value on failure.
+ */
+static double measure(Run_t* run, long* peakRss)
+{
+    struct rusage usage;
+    double        rate = -1;
+    int           fds[2];
+    int           status;
+    pid_t         child;
+
+    if (pipe(fds) != 0 || (child = fork()) < 0)
+    {
+        return -1;
+    }
+
+    if (child == 0)
+    {
+        pthread_t       threads[MAX_THREADS];
+        Worker_t        workers[MAX_THREADS];
+        struct timespec start;
+        uint32_t        i;
+
+        pthread_barrier_init(&run->start, NULL, run->threads + 1);
+
+        for (i = 0; i < run->threads; i++)
+        {
+            workers[i].run = run;
+            workers[i].id  = i;
+
+            if (pthread_create(&threads[i], NULL, worker, &workers[i]) != 0)
+            {
+                _exit(1);
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_barrier_wait(&run->start);
+
+        for (i = 0; i < run->threads; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+
+        rate = run->operations / elapsed(&start);
+
+        write(fds[1], &rate, sizeof(rate));
+        _exit(0);
+    }
+
+    close(fds[1]);
+
+    if (read(fds[0], &rate, sizeof(rate)) != sizeof(rate))
+    {
+        rate = -1;
+    }
+
+    close(fds[0]);
+
+    if (wait4(child, &status, 0, &usage) != child || status != 0)
+    {
+        return -1;
+    }
+
+    *peakRss = usage.ru_maxrss;
+
+    return rate;
+}
+
+int main(int argc, char** argv)
+{
+    static const struct
+    {
+        const char* name;
+        void      (*workload)(Run_t*, uint32_t);
+
+    } workloads[] =
+    {
+        { "churn", churn      },
+        { "xfree", xfree      },
+        { "pool",  sharedPool },
+    };
+
+    long     cores      = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t maxThreads = (argc > 1) ? atoi(argv[1]) : (cores > 0 ? cores : 1);
+    uint64_t operations = (argc > 2) ? strtoull(argv[2], NULL, 10) : DEFAULT_OPERATIONS;
+    uint32_t w;
+    uint32_t a;
+
+    if (maxThreads < 1 || maxThreads > MAX_THREADS)
+    {
+        printf("mt_bench: threads must be 1 to %d\n", MAX_THREADS);
+        return 1;
+    }
+
+    printf("%s\n", "multi-threaded scalability benchmark");
+    printf("%-6s %-7s %7s %16s %10s %12s\n", "load", "malloc", "threads", "ops/s per thread", "scaling", "peak RSS");
+
+    for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        for (a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++)
+        {
+            double   single = 0;
+            uint32_t threads;
+
+            // Powers of two, then the core count
+            for (threads = 1; ; threads *= 2)
+            {
+                Run_t  run;
+                long   peakRss = 0;
+                double rate;
+
+                if (threads > maxThreads)
+                {
+                    threads = maxThreads;
+                }
+
+                memset(&run, 0, sizeof(run));
+                run.allocator  = &allocators[a];
+                run.workload   = workloads[w].workload;
+                run.threads    = threads;
+                run.operations = operations;
+
+                rate = measure(&run, &peakRss);
+
+                if (rate < 0)
+                {
+                    printf("mt_bench: %s with %s and %d threads failed\n", workloads[w].name, allocators[a].name, threads);
+                    return 1;
+                }
+
+                if (threads == 1)
+                {
+                    single = rate;
+                }
+
+                printf("%-6s %-7s %7d %16.0f %9.0f%% %9ld KB\n",
+                       workloads[w].name, allocators[a].name, threads, rate, 100 * rate / single, peakRss);
+
+                if (threads == maxThreads)
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,169 @@
+/* Pointer chasing benchmark: linked lists are grown in a fragmented heap,
+ * then walked. With malloc the nodes of a list land in whatever free region
+ * comes first; with halloc_malloc_near each node is placed in the free
+ * region closest to the previous one of its list.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "malloc.h"
+
+#define LISTS               64
+#define NODES               256         // Nodes in each list
+#define FILLERS             (LISTS * NODES * 2)
+#define WALKS               100
+#define PAGE                4096
+
+typedef struct Node_s
+{
+    struct Node_s* next;
+    uint64_t       value;
+    char           payload[32];
+
+} Node_t;
+
+static void*   fillers[FILLERS];
+static Node_t* heads[LISTS];
+
+static double elapsed(struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Leaves free regions of various sizes all over the heap */
+static void fragment()
+{
+    unsigned int seed = 1;
+    int          i;
+
+    for (i = 0; i < FILLERS; i++)
+    {
+        fillers[i] = malloc(16 + rand_r(&seed) % 112);
+    }
+
+    for (i = 0; i < FILLERS; i++)
+    {
+        if (rand_r(&seed) & 1)
+        {
+            free(fillers[i]);
+            fillers[i] = NULL;
+        }
+    }
+}
+
+/* Grows the lists one after the other.
+ *
+ * Returns the percentage of consecutive nodes in the same page.
+ */
+static double build(int near)
+{
+    int samePage = 0;
+    int i;
+    int j;
+
+    for (i = 0; i < LISTS; i++)
+    {
+        Node_t* tail = NULL;
+
+        for (j = 0; j < NODES; j++)
+        {
+            Node_t* node = (near && tail != NULL) ? halloc_malloc_near(tail, sizeof(Node_t)) : malloc(sizeof(Node_t));
+
+            node->next  = NULL;
+            node->value = j;
+
+            if (tail == NULL)
+            {
+                heads[i] = node;
+            }
+            else
+            {
+                tail->next = node;
+                samePage  += ((uintptr_t)node / PAGE == (uintptr_t)tail / PAGE);
+            }
+
+            tail = node;
+        }
+    }
+
+    return 100.0 * samePage / (LISTS * (NODES - 1));
+}
+
+/* Returns the nanoseconds per node visited */
+static double walk(uint64_t* checksum)
+{
+    struct timespec start;
+    int             k;
+    int             i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (k = 0; k < WALKS; k++)
+    {
+        for (i = 0; i < LISTS; i++)
+        {
+            Node_t* it;
+
+            for (it = heads[i]; it != NULL; it = it->next)
+            {
+                *checksum += it->value;
+            }
+        }
+    }
+
+    return elapsed(&start) * 1e9 / ((double)WALKS * LISTS * NODES);
+}
+
+static void destroy()
+{
+    int i;
+
+    for (i = 0; i < LISTS; i++)
+    {
+        while (heads[i] != NULL)
+        {
+            Node_t* next = heads[i]->next;
+
+            free(heads[i]);
+            heads[i] = next;
+        }
+    }
+}
+
+int main()
+{
+    uint64_t plainChecksum = 0;
+    uint64_t nearChecksum  = 0;
+    double   plainLocality;
+    double   nearLocality;
+    double   plainTime;
+    double   nearTime;
+
+    fragment();
+
+    plainLocality = build(0);
+    plainTime     = walk(&plainChecksum);
+    destroy();
+
+    nearLocality = build(1);
+    nearTime     = walk(&nearChecksum);
+    destroy();
+
+    printf("%s\n", "pointer chasing benchmark");
+    printf("  malloc             : %6.2f ns/node, %5.1f%% of next nodes in the same page\n", plainTime, plainLocality);
+    printf("  halloc_malloc_near : %6.2f ns/node, %5.1f%% of next nodes in the same page (%.2fx)\n", nearTime, nearLocality, plainTime / nearTime);
+
+    if (plainChecksum != nearChecksum)
+    {
+        printf("near_bench: checksums differ\n");
+        return 1;
+    }
+
+    return 0;
+}
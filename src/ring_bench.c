@@ -0,0 +1,133 @@
+/* Ring buffer benchmark: a producer writes variable sized messages which a
+ * consumer parses in place. With a plain ring a message crossing the end
+ * must be written in two parts and copied into a scratch buffer before it
+ * can be parsed; with halloc_ring_alloc it is always contiguous.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "malloc.h"
+
+#define RING_SIZE           (64 * 1024)
+#define MAX_MESSAGE         4096
+#define TOTAL_BYTES         (8LL * 1024 * 1024 * 1024)
+
+static unsigned char message[MAX_MESSAGE];
+static unsigned char scratch[MAX_MESSAGE];
+
+static double elapsed(struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static uint32_t parse(const unsigned char* data, size_t length)
+{
+    uint32_t sum = 0;
+    size_t   i;
+
+    for (i = 0; i < length; i += 64)
+    {
+        sum += data[i];
+    }
+
+    return sum;
+}
+
+static double run(unsigned char* ring, int doubleMapped, uint32_t* checksum)
+{
+    struct timespec start;
+    long long       produced = 0;
+    size_t          head     = 0;
+    unsigned int    seed     = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (produced < TOTAL_BYTES)
+    {
+        size_t length = 64 + (rand_r(&seed) % (MAX_MESSAGE - 64));
+        size_t offset = head % RING_SIZE;
+
+        // Producer
+        if (doubleMapped || offset + length <= RING_SIZE)
+        {
+            memcpy(ring + offset, message, length);
+        }
+        else
+        {
+            memcpy(ring + offset, message, RING_SIZE - offset);
+            memcpy(ring, message + RING_SIZE - offset, length - (RING_SIZE - offset));
+        }
+
+        // Consumer
+        if (doubleMapped || offset + length <= RING_SIZE)
+        {
+            *checksum += parse(ring + offset, length);
+        }
+        else
+        {
+            memcpy(scratch, ring + offset, RING_SIZE - offset);
+            memcpy(scratch + RING_SIZE - offset, ring, length - (RING_SIZE - offset));
+            *checksum += parse(scratch, length);
+        }
+
+        head     += length;
+        produced += length;
+    }
+
+    return produced / elapsed(&start) / (1024 * 1024);
+}
+
+int main()
+{
+    unsigned char* plain  = malloc(RING_SIZE);
+    unsigned char* mirror = halloc_ring_alloc(RING_SIZE);
+    uint32_t       plainChecksum  = 0;
+    uint32_t       mirrorChecksum = 0;
+    double         plainRate;
+    double         mirrorRate;
+    int            i;
+
+    if (plain == NULL || mirror == NULL)
+    {
+        printf("ring_bench: allocation failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < MAX_MESSAGE; i++)
+    {
+        message[i] = (unsigned char)i;
+    }
+
+    // The second mapping shows the first one
+    mirror[0] = 42;
+    if (mirror[RING_SIZE] != 42)
+    {
+        printf("ring_bench: ring buffer is not mirrored\n");
+        return 1;
+    }
+
+    plainRate  = run(plain, 0, &plainChecksum);
+    mirrorRate = run(mirror, 1, &mirrorChecksum);
+
+    printf("%s\n", "ring buffer benchmark");
+    printf("  plain ring        : %.0f MB/s\n", plainRate);
+    printf("  halloc_ring_alloc : %.0f MB/s (%.2fx)\n", mirrorRate, mirrorRate / plainRate);
+
+    if (plainChecksum != mirrorChecksum)
+    {
+        printf("ring_bench: checksums differ\n");
+        return 1;
+    }
+
+    halloc_ring_free(mirror, RING_SIZE);
+    free(plain);
+
+    return 0;
+}
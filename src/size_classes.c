@@ -0,0 +1,267 @@
+/* Free list classes fitted to a workload: reads the allocation sizes of a
+ * profile and writes a size_classes.h whose class limits minimize the slack
+ * between the regions allocated and the limit of their class, i.e. the
+ * internal fragmentation if each allocation took the largest region of its
+ * free list. The limits are chosen among the region sizes of the profile by
+ * dynamic programming, so the fit is exact for the given number of classes.
+ *
+ * The profile is text, one record per line, '#' starting a comment:
+ *
+ *   <size>             one allocation of size bytes (a trace)
+ *   <size> <count>     count allocations of size bytes (a histogram)
+ *
+ *   size_classes <profile|-> [classes] [output header]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define MIN_CLASSES         2
+#define MAX_CLASSES         32
+#define DEFAULT_CLASSES     6
+#define REGION_ALIGNMENT    16          // Regions are 16 byte aligned
+#define REGION_OVERHEAD     8           // Header and footer of a region
+#define REGION_MINIMUM      28          // Smallest region able to hold the free list links once freed
+#define MAX_LIMIT           16384       // Largest class limit, bigger regions all go to the last list
+#define POINTS              (MAX_LIMIT / REGION_ALIGNMENT + 1)
+
+static uint64_t counts[POINTS];                     // Allocations of each region size, by size / REGION_ALIGNMENT
+static uint64_t largeCount;                         // Allocations of regions bigger than MAX_LIMIT
+
+static uint32_t sizes[POINTS];                      // Region sizes of the profile, ascending
+static uint64_t weights[POINTS];                    // Allocations of each of them
+static uint64_t prefixCount[POINTS + 1];
+static uint64_t prefixBytes[POINTS + 1];
+static uint64_t cost[MAX_CLASSES][POINTS];          // Least slack of the first sizes in the first classes
+static uint32_t split[MAX_CLASSES][POINTS];         // First size of the last of those classes
+
+/* Size of the region holding an allocation, as carved from a free region */
+static uint64_t regionSize(uint64_t size)
+{
+    uint64_t region = size + REGION_OVERHEAD;
+
+    if (region < REGION_MINIMUM)
+    {
+        region = REGION_MINIMUM;
+    }
+
+    // The next region must start so its payload is aligned too
+    return (region / REGION_ALIGNMENT + 1) * REGION_ALIGNMENT;
+}
+
+/* Returns 0 if the profile was read, -1 otherwise */
+static int readProfile(FILE* input)
+{
+    char          line[256];
+    unsigned long lineNumber = 0;
+
+    while (fgets(line, sizeof(line), input) != NULL)
+    {
+        unsigned long long size;
+        unsigned long long count = 1;
+        char*              comment = strchr(line, '#');
+        int                fields;
+        uint64_t           region;
+
+        lineNumber++;
+
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+
+        fields = sscanf(line, "%llu %llu", &size, &count);
+
+        if (fields == EOF)
+        {
+            continue; // Blank line
+        }
+
+        if (fields < 1)
+        {
+            fprintf(stderr, "size_classes: line %lu: expected <size> [count]\n", lineNumber);
+            return -1;
+        }
+
+        region = regionSize(size);
+
+        if (region > MAX_LIMIT)
+        {
+            largeCount += count;
+        }
+        else
+        {
+            counts[region / REGION_ALIGNMENT] += count;
+        }
+    }
+
+    return 0;
+}
+
+/* Slack of the sizes first to last in a class limited by the last one */
+static uint64_t classCost(uint32_t first, uint32_t last)
+{
+    uint64_t count = prefixCount[last + 1] - prefixCount[first];
+    uint64_t bytes = prefixBytes[last + 1] - prefixBytes[first];
+
+    return count * sizes[last] - bytes;
+}
+
+/* Fits classes limits to the points sizes, returns how many were fitted */
+static uint32_t fit(uint32_t points, uint32_t classes, uint32_t* limits)
+{
+    uint32_t c;
+    uint32_t i;
+    uint32_t j;
+
+    // The largest size limits the last fitted class, a class per size if they are few
+    if (classes > points)
+    {
+        classes = points;
+    }
+
+    for (j = 0; j < points; j++)
+    {
+        cost[0][j]  = classCost(0, j);
+        split[0][j] = 0;
+    }
+
+    for (c = 1; c < classes; c++)
+    {
+        for (j = c; j < points; j++)
+        {
+            cost[c][j] = UINT64_MAX;
+
+            for (i = c; i <= j; i++)
+            {
+                uint64_t total = cost[c - 1][i - 1] + classCost(i, j);
+
+                if (total < cost[c][j])
+                {
+                    cost[c][j]  = total;
+                    split[c][j] = i;
+                }
+            }
+        }
+    }
+
+    // Walked back from the largest size
+    for (c = classes, j = points - 1; c > 0; c--)
+    {
+        limits[c - 1] = sizes[j];
+        j = split[c - 1][j] - 1;
+    }
+
+    return classes;
+}
+
+static void writeHeader(FILE* output, const char* profile, const uint32_t* limits, uint32_t fitted, uint64_t requests, uint64_t slack)
+{
+    uint32_t i;
+
+    fprintf(output, "/* Classes of the free lists of halloc, generated by size_classes from\n");
+    fprintf(output, " * %s: %llu allocations, %.1f bytes of slack per allocation up to\n", profile,
+            (unsigned long long)requests, (requests > 0) ? (double)slack / requests : 0.0);
+    fprintf(output, " * %u bytes, %llu larger ones. Do not edit.\n", limits[fitted - 1], (unsigned long long)largeCount);
+    fprintf(output, " */\n\n");
+    fprintf(output, "#ifndef HALLOC_SIZE_CLASSES_H\n");
+    fprintf(output, "#define HALLOC_SIZE_CLASSES_H\n\n");
+    fprintf(output, "#define HALLOC_SIZE_CLASSES         %u\n", fitted + 1);
+    fprintf(output, "#define HALLOC_SIZE_CLASS_LIMITS    ");
+
+    for (i = 0; i < fitted; i++)
+    {
+        fprintf(output, (i == 0) ? "%u" : ", %u", limits[i]);
+    }
+
+    fprintf(output, "\n\n#endif\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* profile = (argc > 1) ? argv[1] : NULL;
+    uint32_t    classes = (argc > 2) ? atoi(argv[2]) : DEFAULT_CLASSES;
+    const char* header  = (argc > 3) ? argv[3] : NULL;
+    FILE*       input   = stdin;
+    FILE*       output  = stdout;
+    uint32_t    limits[MAX_CLASSES];
+    uint32_t    points  = 0;
+    uint32_t    fitted;
+    uint32_t    first;
+    uint32_t    i;
+
+    if (profile == NULL || classes < MIN_CLASSES || classes > MAX_CLASSES)
+    {
+        fprintf(stderr, "usage: size_classes <profile|-> [classes (%d to %d)] [output header]\n", MIN_CLASSES, MAX_CLASSES);
+        return 2;
+    }
+
+    if (strcmp(profile, "-") != 0 && (input = fopen(profile, "r")) == NULL)
+    {
+        perror(profile);
+        return 1;
+    }
+
+    if (readProfile(input) != 0)
+    {
+        return 1;
+    }
+
+    for (i = 0; i < POINTS; i++)
+    {
+        if (counts[i] != 0)
+        {
+            sizes[points]           = i * REGION_ALIGNMENT;
+            weights[points]         = counts[i];
+            prefixCount[points + 1] = prefixCount[points] + weights[points];
+            prefixBytes[points + 1] = prefixBytes[points] + weights[points] * sizes[points];
+            points++;
+        }
+    }
+
+    if (points == 0)
+    {
+        fprintf(stderr, "size_classes: no allocation of up to %d bytes in %s\n", MAX_LIMIT, profile);
+        return 1;
+    }
+
+    // The last class is the list of the regions above every limit
+    fitted = fit(points, classes - 1, limits);
+
+    if (header != NULL && (output = fopen(header, "w")) == NULL)
+    {
+        perror(header);
+        return 1;
+    }
+
+    writeHeader(output, profile, limits, fitted, prefixCount[points], cost[fitted - 1][points - 1]);
+
+    if (output != stdout && fclose(output) != 0)
+    {
+        perror(header);
+        return 1;
+    }
+
+    // The fit, class by class
+    for (i = 0, first = 0; i < fitted; i++)
+    {
+        uint32_t last = first;
+
+        while (last + 1 < points && sizes[last + 1] <= limits[i])
+        {
+            last++;
+        }
+
+        fprintf(stderr, "  <= %5u : %12llu allocations, %7.1f bytes of slack each\n", limits[i],
+                (unsigned long long)(prefixCount[last + 1] - prefixCount[first]),
+                (double)classCost(first, last) / (prefixCount[last + 1] - prefixCount[first]));
+
+        first = last + 1;
+    }
+
+    fprintf(stderr, "  >  %5u : %12llu allocations\n", limits[fitted - 1], (unsigned long long)largeCount);
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+/* Classes of the free lists of halloc: each list holds the free regions up to
+ * its limit (region sizes, boundary tags included), the last one the larger
+ * regions. These are the default classes; size_classes fits them to the
+ * allocation sizes of a workload and writes a header like this one, given to
+ * the build with -DHALLOC_SIZE_PROFILE=<profile>.
+ */
+
+#ifndef HALLOC_SIZE_CLASSES_H
+#define HALLOC_SIZE_CLASSES_H
+
+#define HALLOC_SIZE_CLASSES         6
+#define HALLOC_SIZE_CLASS_LIMITS    32, 64, 128, 256, 512
+
+#endif
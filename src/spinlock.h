@@ -0,0 +1,34 @@
+/* Spinlocks shared by the translation units of the allocator, for the locks
+ * only held for a few instructions at a time. Internal, not installed.
+ */
+
+#ifndef HALLOC_SPINLOCK_H
+#define HALLOC_SPINLOCK_H
+
+#include <stdint.h>
+
+/**
+ * @brief spinLock Take a lock held only for a few instructions at a time
+ * @param lock     The lock
+ *************************************************************************************************/
+static inline void spinLock(uint32_t* lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0)
+        {
+            // Spin on a read, the owner holds it for a few instructions
+        }
+    }
+}
+
+/**
+ * @brief spinUnlock Release a lock taken by spinLock
+ * @param lock       The lock
+ *************************************************************************************************/
+static inline void spinUnlock(uint32_t* lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,169 @@
+/* Call site segregation benchmark: a linked list is grown while another call
+ * site allocates short-lived records in between, then the list is walked.
+ * Without streams the nodes are interleaved with the records and, once these
+ * are freed, with holes; with halloc_set_streams each call site fills blocks
+ * of its own, so the nodes end up next to each other and the blocks of the
+ * records are released when they die.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "malloc.h"
+
+#define NODES               100000
+#define RECORDS             64          // Records alive at a time
+#define WALKS               50
+#define STREAMS             8
+#define PAGE                4096
+
+typedef struct Node_s
+{
+    struct Node_s* next;
+    uint64_t       value;
+    char           payload[24];
+
+} Node_t;
+
+static Node_t* head;
+static void*   records[RECORDS];
+
+static double elapsed(struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static __attribute__((noinline)) Node_t* newNode()
+{
+    return malloc(sizeof(Node_t));
+}
+
+static __attribute__((noinline)) void* newRecord(size_t size)
+{
+    return malloc(size);
+}
+
+/* Grows the list, replacing a record after each node.
+ *
+ * Returns the percentage of consecutive nodes in the same page.
+ */
+static double build(double* seconds)
+{
+    struct timespec start;
+    unsigned int    seed     = 1;
+    Node_t*         tail     = NULL;
+    int             samePage = 0;
+    int             i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i = 0; i < NODES; i++)
+    {
+        Node_t* node = newNode();
+        int     k    = rand_r(&seed) % RECORDS;
+
+        node->next  = NULL;
+        node->value = i;
+
+        if (tail == NULL)
+        {
+            head = node;
+        }
+        else
+        {
+            tail->next = node;
+            samePage  += ((uintptr_t)node / PAGE == (uintptr_t)tail / PAGE);
+        }
+
+        tail = node;
+
+        free(records[k]);
+        records[k] = newRecord(16 + rand_r(&seed) % 240);
+    }
+
+    *seconds = elapsed(&start);
+
+    for (i = 0; i < RECORDS; i++)
+    {
+        free(records[i]);
+        records[i] = NULL;
+    }
+
+    return 100.0 * samePage / (NODES - 1);
+}
+
+/* Returns the nanoseconds per node visited */
+static double walk(uint64_t* checksum)
+{
+    struct timespec start;
+    int             k;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (k = 0; k < WALKS; k++)
+    {
+        Node_t* it;
+
+        for (it = head; it != NULL; it = it->next)
+        {
+            *checksum += it->value;
+        }
+    }
+
+    return elapsed(&start) * 1e9 / ((double)WALKS * NODES);
+}
+
+static void destroy()
+{
+    while (head != NULL)
+    {
+        Node_t* next = head->next;
+
+        free(head);
+        head = next;
+    }
+}
+
+static void run(const char* name, uint32_t streams, uint64_t* checksum)
+{
+    double buildTime;
+    double locality;
+    double walkTime;
+    size_t mapped;
+
+    halloc_set_streams(streams);
+
+    locality = build(&buildTime);
+    mapped   = mallinfo2().arena;
+    walkTime = walk(checksum);
+
+    destroy();
+    halloc_set_streams(0);
+
+    printf("  %-10s : %6.2f ns/node walked, %5.1f%% of next nodes in the same page, %6.1f KiB mapped, %5.1f ms to build\n",
+           name, walkTime, locality, mapped / 1024.0, buildTime * 1e3);
+}
+
+int main()
+{
+    uint64_t plainChecksum  = 0;
+    uint64_t streamChecksum = 0;
+
+    printf("%s\n", "call site segregation benchmark");
+
+    run("malloc", 0, &plainChecksum);
+    run("streams", STREAMS, &streamChecksum);
+
+    if (plainChecksum != streamChecksum)
+    {
+        printf("stream_bench: checksums differ\n");
+        return 1;
+    }
+
+    return 0;
+}